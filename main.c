@@ -1,7 +1,44 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <fcntl.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#include <errno.h>
+#include <stdint.h>
+
+#ifdef HAVE_ZLIB
+#define HAVE_COMPRESSION_GZ			(1)
+#else
+#define HAVE_COMPRESSION_GZ			(0)
+#endif
+#ifdef HAVE_ZSTD
+#define HAVE_COMPRESSION_ZSTD		(1)
+#else
+#define HAVE_COMPRESSION_ZSTD		(0)
+#endif
 
 #define MAX_DDD_TEXTURE				(4)
 #define MAX_DDD_SHADOW_TEXTURE		(4)
@@ -26,7 +63,82 @@ enum ErrCode
 	EC_NOARGS,
 	EC_NOFILE,
 	EC_WRERR,
-	EC_NOOP
+	EC_NOOP,
+	EC_BADFILE,
+	EC_MISMATCH
+};
+
+#define MAX_VALIDATION_ERRORS		(16)
+
+#define REDUCE_NORMAL_TOLERANCE		(0.01f)	// radians
+
+#define OBJ_GROUP_NAME_SIZE			(64)
+#define OBJ_GROUP_NAME_FORMAT		"63"
+#define OBJ_MALFORMED				(-2)	// vertex line without enough numbers
+
+#define GPU_MAGIC					"S3MB"
+#define GPU_VERSION					(1)
+#define GPU_HEADER_SIZE				(80)
+#define GPU_VERTEX_SIZE				(24)
+#define GPU_TOO_MANY_VERTICES		(-2)	// more distinct pairs than 16-bit indices reach
+
+#define BVH_MAGIC					"S3BV"
+#define BVH_VERSION					(1)
+#define BVH_HEADER_SIZE				(48)
+#define BVH_BINS					(16)
+#define BVH_MAX_LEAF_SIZE			(8)
+#define BVH_TRAVERSAL_COST			(1.0f)	// relative to one triangle test
+#define BVH_PARALLEL_SIZE			(4096)
+
+#define CACHE_ENTRIES				(64)
+#define CACHE_BYTES					(256 << 20)
+
+#define PREVIEW_SIZE				(256)
+#define PREVIEW_MAX_SIZE			(8192)	// keeps pixel counts far from int overflow
+#define PREVIEW_TILE_SIZE			(32)
+
+#define IO_BATCH_DEPTH				(64)
+#define IO_FALLBACK_THREADS			(8)
+#define IO_MAX_CHUNK				(1 << 30)
+
+#define COMPRESS_BLOCK_SIZE			(1 << 20)
+#define COMPRESS_QUEUE_SIZE			(8)
+#define COMPRESS_MAX_THREADS		(64)
+
+enum IoSlotState
+{
+	IO_SLOT_FREE,
+	IO_SLOT_BUSY,
+	IO_SLOT_READY
+};
+
+enum IoStep
+{
+	IO_STEP_STATX,
+	IO_STEP_OPEN,
+	IO_STEP_READ,
+	IO_STEP_WRITE,
+	IO_STEP_CLOSE
+};
+
+// changes applied by the transform command
+struct transform
+{
+	float scale;	// uniform scale factor
+	float translate[3];	// added after scaling
+	int center;	// move the XY centre of the base models to the origin, their bottom to Z 0
+	int scaling;	// new Scaling value, 0 keeps it, -1 picks the finest one that fits
+	int flip_u;
+	int flip_v;
+	int flags[MAX_DDD_TEXTURE];	// -1 keeps the texture flags
+	int alpha[MAX_DDD_TEXTURE];	// -1 keeps the texture alpha
+};
+
+enum Compression
+{
+	COMPRESSION_NONE,
+	COMPRESSION_GZ,
+	COMPRESSION_ZSTD
 };
 
 const char *action_strings[] = {
@@ -84,8 +196,48 @@ const char *action_strings[] = {
 unsigned char *ddd = NULL;
 size_t ddd_size = 0;
 
+// tables decoded by load_ddd(), kept with the file in serve mode
+struct ddd_tables
+{
+	unsigned char *data;	// the DDD file they belong to
+	unsigned char *base_models[256];
+	unsigned char **frames;	// bone frames plus one past the last, NULL if they are external
+};
+struct ddd_tables *ddd_tables = NULL;
+
+// compression of OBJ output files
+int output_compression = COMPRESSION_NONE;
+
+// worker threads for conversion, 0 means one per core
+int thread_num = 0;
+
 int load_file(const char *filename, unsigned char **buff, size_t *size);
 
+// a file read by the batch I/O stage, handed out in input order
+struct io_file
+{
+	int index;
+	const char *path;
+	unsigned char *data;
+	size_t size;
+	int error;	// errno of the failed read, 0 on success
+};
+
+struct io_batch;
+struct io_batch *io_batch_open(int count, char *paths[]);
+int io_batch_next(struct io_batch *io, struct io_file *file);
+int io_batch_write(struct io_batch *io, const char *path, unsigned char *data, size_t size);
+int io_batch_close(struct io_batch *io);
+int load_ddd(const char *path);
+void release_ddd(void);
+
+int serve(const char *socket_path);
+int client(const char *socket_path);
+int serve_stream(FILE *in, FILE *out);
+int run_job(const char *line, FILE *out);
+int json_get_string(const char *json, const char *key, char *value, size_t size);
+void fwrite_json_string(FILE *file, const char *string, size_t size);
+
 unsigned short get_scaling(unsigned char *ddd);
 unsigned short get_header_flags(unsigned char *ddd);
 unsigned char get_base_model_num(unsigned char *ddd);
@@ -134,24 +286,350 @@ char *get_texture_flag_string(unsigned char flags);
 
 int ddd_to_obj(const char *path);
 int obj_to_ddd(char *path);
+void write_obj_base_model(FILE *out, const char *path, unsigned char *ddd, unsigned char *base_model);
+void write_obj_bone_frame(FILE *out, unsigned char *ddd, unsigned char *bone_frame, int index);
+int convert_obj(FILE *in, FILE *out);
+int pack_obj(const char *outpath, int count, char *paths[]);
+void write_ddd_header(FILE *out, float scale, int base_model_num, int bone_frame_num);
+int list_obj_groups(FILE *in, char (*groups)[OBJ_GROUP_NAME_SIZE], int max);
+int write_ddd_base_model(FILE *in, FILE *out, float scale, const char *group, float *bounds);
+void write_ddd_triangle(FILE *out, int ix, int itx, int iy, int ity, int iz, int itz,
+	const int *vmap, const int *tvmap, int obj_vertex_num, int obj_texture_vertex_num);
+void write_ddd_bone_frame(FILE *out, float scale, int base_model_id, const float *bounds);
+int preview_files(int count, char *paths[], int size);
+int stats_files(int count, char *paths[], const char *outpath);
+void write_stats_base_model(FILE *out, unsigned char *ddd, unsigned char *base_model);
+int write_png(FILE *out, const unsigned char *rgba, int width, int height);
+int ddd_to_gpu(const char *path);
+int write_gpu_base_model(FILE *out, unsigned char *ddd, unsigned char *base_model);
+int ddd_to_bvh(const char *path);
+int write_bvh_base_model(FILE *out, unsigned char *ddd, unsigned char *base_model, int base_model_id);
+int verify_files(int count, char *paths[], int thread_num);
+int verify_ddd(FILE *report, const char *path, unsigned char *ddd, size_t ddd_size);
+int dedup_ddd(const char *path, const char *outpath);
+int reduce_ddd(const char *path, float tolerance, const char *outpath);
+int parse_tolerance(const char *text, float *tolerance);
+int parse_float(const char *text, float *value);
+int transform_ddd(const char *path, const char *outpath, const struct transform *t);
+
+int validate_files(int count, char *paths[]);
+int validate_ddd(FILE *log, const char *path, const unsigned char *ddd, size_t size);
+
+int write_ddd_frames(const char *path, unsigned char *ddd, const unsigned char *keep);
+unsigned long long hash_bytes(const unsigned char *data, size_t size);
+unsigned char **get_bone_frame_table(unsigned char *ddd);
+const char *get_action_string(unsigned char action_id);
+
+FILE *open_output(const char *filename, const char *mode);
+int finish_output(void);
 
 void fwrite_byte(FILE *file, unsigned char byte);
 void fwrite_short(FILE *file, unsigned short word);
+void fwrite_le_short(FILE *file, unsigned short word);
+void fwrite_le_int(FILE *file, unsigned int dword);
+void fwrite_le_float(FILE *file, float value);
 
 char *read_triplet(char *string, int *a, int *b, int *c);
 
 int main(int argc, char *argv[])
 {
-	printf("SoulFu 3D Model Converter\n\n");
+	// the job server and its client talk JSON on stdout
+	if (argc < 2 || (strcmp(argv[1], "serve") && strcmp(argv[1], "client")))
+		printf("SoulFu 3D Model Converter\n\n");
 
 	if (argc < 2)
 	{
 		printf("No arguments given.\n\n");
 		printf("How to use?\n");
 		printf("  %s <filename>    convert DDD or OBJ file\n", argv[0]);
+		printf("  %s --compress gz|zst <filename.ddd>    convert DDD file to compressed OBJ files\n", argv[0]);
+		printf("  %s -j <threads> <filename.ddd>    convert base models of DDD file on several threads\n", argv[0]);
+		printf("  %s gpu <filename.ddd>    convert DDD file to binary vertex/index buffers\n", argv[0]);
+		printf("  %s bvh <filename.ddd>    write collision BVH and joint spheres of DDD file\n", argv[0]);
+		printf("  %s serve [--socket path]    run jobs given as JSON lines on stdin or a Unix socket\n", argv[0]);
+		printf("  %s client <path>    send JSON jobs from stdin to a serve socket and print the results\n", argv[0]);
+		printf("  %s pack <output.ddd> <filename.obj>...    pack OBJ files or their groups as base models of one DDD file\n", argv[0]);
+		printf("  %s preview [-j threads] [--size pixels] <filename.ddd>...    render PNG previews of base models\n", argv[0]);
+		printf("  %s stats [-j threads] [-o output.json] <filename.ddd>...    write geometry statistics as JSON\n", argv[0]);
+		printf("  %s dedup <input.ddd> [output.ddd]    report repeated bone frames, optionally collapse them\n", argv[0]);
+		printf("  %s --validate <filename>...    check DDD files for structural errors\n", argv[0]);
+		printf("  %s verify [-j threads] <filename>...    check DDD->OBJ->DDD round trip\n", argv[0]);
+		printf("  %s reduce <input.ddd> <tolerance> [output.ddd]    drop bone frames that can be interpolated\n", argv[0]);
+		printf("  %s transform [options] <input.ddd> <output.ddd>    rescale, move, requantize or retexture DDD file\n", argv[0]);
 		return EC_NOARGS;
 	}
 
+	// leading conversion options
+	while (argc > 3 && argv[1][0] == '-' && strcmp(argv[1], "--validate"))
+	{
+		if (!strcmp(argv[1], "-j"))
+		{
+			thread_num = atoi(argv[2]);
+			argc -= 2;
+			argv += 2;
+			continue;
+		}
+		if (strcmp(argv[1], "--compress"))
+			break;
+
+		if (!strcmp(argv[2], "gz"))
+			output_compression = COMPRESSION_GZ;
+		else if (!strcmp(argv[2], "zst"))
+			output_compression = COMPRESSION_ZSTD;
+		else
+		{
+			printf("Unknown compression %s.\n", argv[2]);
+			return EC_NOARGS;
+		}
+#ifndef HAVE_ZLIB
+		if (output_compression == COMPRESSION_GZ)
+		{
+			printf("This build has no gz support.\n");
+			return EC_NOARGS;
+		}
+#endif
+#ifndef HAVE_ZSTD
+		if (output_compression == COMPRESSION_ZSTD)
+		{
+			printf("This build has no zst support.\n");
+			return EC_NOARGS;
+		}
+#endif
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (!strcmp(argv[1], "--validate"))
+	{
+		if (argc < 3)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		return validate_files(argc - 2, argv + 2);
+	}
+
+	if (!strcmp(argv[1], "verify"))
+	{
+		int first = 2;
+		if (argc > 3 && !strcmp(argv[2], "-j"))
+		{
+			thread_num = atoi(argv[3]);
+			first = 4;
+		}
+		if (argc <= first)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		return verify_files(argc - first, argv + first, thread_num > 0 ? thread_num : sysconf(_SC_NPROCESSORS_ONLN));
+	}
+
+	if (!strcmp(argv[1], "gpu"))
+	{
+		if (argc < 3)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		return ddd_to_gpu(argv[2]);
+	}
+
+	if (!strcmp(argv[1], "bvh"))
+	{
+		if (argc < 3)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		return ddd_to_bvh(argv[2]);
+	}
+
+	if (!strcmp(argv[1], "serve"))
+	{
+		if (argc == 2)
+			return serve(NULL);
+		if (argc != 4 || strcmp(argv[2], "--socket"))
+		{
+			printf("No socket path given.\n");
+			return EC_NOARGS;
+		}
+		return serve(argv[3]);
+	}
+
+	if (!strcmp(argv[1], "client"))
+	{
+		if (argc < 3)
+		{
+			printf("No socket path given.\n");
+			return EC_NOARGS;
+		}
+		return client(argv[2]);
+	}
+
+	if (!strcmp(argv[1], "pack"))
+	{
+		if (argc < 4)
+		{
+			printf("No output or input files given.\n");
+			return EC_NOARGS;
+		}
+		return pack_obj(argv[2], argc - 3, argv + 3);
+	}
+
+	if (!strcmp(argv[1], "preview"))
+	{
+		int size = PREVIEW_SIZE;
+		int first = 2;
+		while (argc > first + 2 && argv[first][0] == '-')
+		{
+			if (!strcmp(argv[first], "-j"))
+				thread_num = atoi(argv[first + 1]);
+			else if (!strcmp(argv[first], "--size"))
+				size = atoi(argv[first + 1]);
+			else
+				break;
+			first += 2;
+		}
+		if (argc <= first)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		if (size < 1 || size > PREVIEW_MAX_SIZE)
+		{
+			printf("Preview size must be between 1 and %d.\n", PREVIEW_MAX_SIZE);
+			return EC_NOARGS;
+		}
+		return preview_files(argc - first, argv + first, size);
+	}
+
+	if (!strcmp(argv[1], "stats"))
+	{
+		const char *outpath = "stats.json";
+		int first = 2;
+		while (argc > first + 2 && argv[first][0] == '-')
+		{
+			if (!strcmp(argv[first], "-j"))
+				thread_num = atoi(argv[first + 1]);
+			else if (!strcmp(argv[first], "-o"))
+				outpath = argv[first + 1];
+			else
+				break;
+			first += 2;
+		}
+		if (argc <= first)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		return stats_files(argc - first, argv + first, outpath);
+	}
+
+	if (!strcmp(argv[1], "dedup"))
+	{
+		if (argc < 3)
+		{
+			printf("No input file given.\n");
+			return EC_NOARGS;
+		}
+		return dedup_ddd(argv[2], argc > 3 ? argv[3] : NULL);
+	}
+
+	if (!strcmp(argv[1], "reduce"))
+	{
+		if (argc < 4)
+		{
+			printf("No input file or tolerance given.\n");
+			return EC_NOARGS;
+		}
+		float tolerance;
+		if (parse_tolerance(argv[3], &tolerance) < 0)
+		{
+			printf("Tolerance must be a non-negative number.\n");
+			return EC_NOARGS;
+		}
+		return reduce_ddd(argv[2], tolerance, argc > 4 ? argv[4] : NULL);
+	}
+
+	if (!strcmp(argv[1], "transform"))
+	{
+		struct transform t = { 1.0f, { 0.0f, 0.0f, 0.0f }, 0, 0, 0, 0, { -1, -1, -1, -1 }, { -1, -1, -1, -1 } };
+		int i = 2;
+		for (; i < argc && argv[i][0] == '-'; ++i)
+		{
+			if (!strcmp(argv[i], "--scale") && i + 1 < argc)
+			{
+				if (parse_float(argv[++i], &t.scale) < 0)
+				{
+					printf("Invalid value %s for --scale.\n", argv[i]);
+					return EC_NOARGS;
+				}
+			}
+			else if (!strcmp(argv[i], "--translate") && i + 3 < argc)
+			{
+				for (int k = 0; k < 3; ++k)
+					if (parse_float(argv[++i], &t.translate[k]) < 0)
+					{
+						printf("Invalid value %s for --translate.\n", argv[i]);
+						return EC_NOARGS;
+					}
+			}
+			else if (!strcmp(argv[i], "--center"))
+				t.center = 1;
+			else if (!strcmp(argv[i], "--scaling") && i + 1 < argc)
+			{
+				// 0 is what the header keeps when the option is not given
+				char *end;
+				long value = strtol(argv[++i], &end, 10);
+				if (!strcmp(argv[i], "auto"))
+					t.scaling = -1;
+				else if (end == argv[i] || *end || value < 1 || value > 65535)
+				{
+					printf("Scaling must be auto or between 1 and 65535.\n");
+					return EC_NOARGS;
+				}
+				else
+					t.scaling = value;
+			}
+			else if (!strcmp(argv[i], "--flip-u"))
+				t.flip_u = 1;
+			else if (!strcmp(argv[i], "--flip-v"))
+				t.flip_v = 1;
+			else if ((!strcmp(argv[i], "--flags") || !strcmp(argv[i], "--alpha")) && i + 2 < argc)
+			{
+				int texture = atoi(argv[i + 1]);
+				int value = strtol(argv[i + 2], NULL, 0);
+				if (texture < 0 || texture >= MAX_DDD_TEXTURE || value < 0 || value > 255)
+				{
+					printf("Invalid texture or value for %s.\n", argv[i]);
+					return EC_NOARGS;
+				}
+				if (!strcmp(argv[i], "--flags"))
+					t.flags[texture] = value;
+				else
+					t.alpha[texture] = value;
+				i += 2;
+			}
+			else
+			{
+				printf("Unknown transform option %s.\n", argv[i]);
+				return EC_NOARGS;
+			}
+		}
+		if (argc < i + 2)
+		{
+			printf("No input or output file given.\n");
+			return EC_NOARGS;
+		}
+		if (!(t.scale > 0.0f))
+		{
+			printf("Scale must be positive.\n");
+			return EC_NOARGS;
+		}
+		return transform_ddd(argv[i], argv[i + 1], &t);
+	}
+
 	const char *ext = NULL;
 
 	ext = strstr(argv[1], ".obj");
@@ -168,15 +646,53 @@ int main(int argc, char *argv[])
 	return EC_NOOP;
 }
 
-int ddd_to_obj(const char *path)
+struct obj_job
 {
-	printf("DDD to OBJ.\n");
+	const char *path;
+	unsigned char **frames;
+	int next;
+	pthread_mutex_t mutex;
+	char filenames[256][32];
+	char written[256];
+};
 
-	if (load_file(path, &ddd, &ddd_size) < 0)
+static void *obj_worker(void *arg)
+{
+	// ddd is shared read-only, each task owns one output file
+	struct obj_job *job = arg;
+	const char *suffix = output_compression == COMPRESSION_GZ ? ".gz" : output_compression == COMPRESSION_ZSTD ? ".zst" : "";
+	int base_model_num = get_base_model_num(ddd);
+	int bone_frame_num = job->frames ? get_bone_frame_num(ddd) : 0;
+	for (;;)
 	{
-		printf("Cannot load the file.\n");
-		return EC_NOFILE;
+		pthread_mutex_lock(&job->mutex);
+		int i = job->next++;
+		pthread_mutex_unlock(&job->mutex);
+		if (i >= base_model_num)
+			break;
+
+		sprintf(job->filenames[i], "model%d.OBJ%s", i, suffix);
+		FILE *out = open_output(job->filenames[i], "w");
+		if (!out)
+			continue;
+
+		write_obj_base_model(out, job->path, ddd, get_base_model_from_id(ddd, i));
+		for (int j = 0; j < bone_frame_num; ++j)
+			if (get_base_model_id(job->frames[j]) == i)
+				write_obj_bone_frame(out, ddd, job->frames[j], j);
+
+		job->written[i] = fclose(out) == 0;
 	}
+	return NULL;
+}
+
+int ddd_to_obj(const char *path)
+{
+	printf("DDD to OBJ.\n");
+
+	int err = load_ddd(path);
+	if (err != EC_NONE)
+		return err;
 
 	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
 	printf("Scaling: %.6f\n", scale);
@@ -205,472 +721,4968 @@ int ddd_to_obj(const char *path)
 		base_model = get_next_base_model(base_model);
 	}
 
-	// convert to OBJ
-	char filename[16];
-	base_model = get_first_base_model(ddd);
+	// convert to OBJ, every base model with its bone frames is an independent task
+	struct obj_job job = { .path = path, .mutex = PTHREAD_MUTEX_INITIALIZER };
+	job.frames = ddd_tables->frames;
+
+	int workers = thread_num > 0 ? thread_num : sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > base_model_num)
+		workers = base_model_num;
+	pthread_t threads[256];
+	int started = 0;
+	for (; started < workers - 1; ++started)
+		if (pthread_create(&threads[started], NULL, obj_worker, &job))
+			break;
+	obj_worker(&job);
+	for (int i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	int ret = EC_NONE;
 	for (int i = 0; i < base_model_num; ++i)
 	{
-		sprintf(filename, "model%d.OBJ", i);
-		FILE *out = fopen(filename, "w");
-		if (!out)
+		if (job.written[i])
+			printf("Base model %d written to %s.\n", i, job.filenames[i]);
+		else
 		{
-			printf("Cannot create %s file.\n", filename);
-			free(ddd);
-			return EC_WRERR;
+			printf("Cannot write %s file.\n", job.filenames[i]);
+			ret = EC_WRERR;
 		}
+	}
 
-		fprintf(out, "# OBJ file generated from SoulFu DDD file %s\n", path);
-		fprintf(out, "#  Scaling: %.6f\n", scale);
-		fprintf(out, "#  Flags: %04x\n", header_flags);
-		if (bff)
-			fprintf(out, "#  Bone frame filename: %c%c%c%c%c%c%c%c\n",
-				bff[0], bff[1], bff[2], bff[3], bff[4], bff[5], bff[6], bff[7]);
+	release_ddd();
+	// failures were reported per file when the outputs were closed
+	if (finish_output() < 0)
+		return EC_WRERR;
+	return ret;
+}
 
-		fprintf(out, "#  Number of vertices: %d\n", get_vertex_num(base_model));
+int obj_to_ddd(char *path)
+{
+	printf("OBJ to DDD.\n");
 
-		fprintf(out, "mtllib materials.mtl\n");
+	printf("Input file: %s\n", path);
+	FILE *in = fopen(path, "r");
+	if (!in)
+	{
+		printf("Cannot load the file.\n");
+		return EC_NOFILE;
+	}
 
-		// vertices
-		int vertices = get_vertex_num(base_model);
-		unsigned char *vtable = get_vertices(base_model);
-		for (int j = 0; j < vertices; ++j)
-		{
-			float x = (signed short)BE_SHORT(vtable[0], vtable[1]) * scale;
-			float y = (signed short)BE_SHORT(vtable[2], vtable[3]) * scale;
-			float z = (signed short)BE_SHORT(vtable[4], vtable[5]) * scale;
-			fprintf(out, "v %.6f %.6f %.6f\n", x, y, z);
+	// construct the output path
+	size_t len = strlen(path);
+	path[len - 3] = 'D';
+	path[len - 2] = 'D';
+	path[len - 1] = 'D';
+	const char *outpath = strrchr(path, '/');
+	if (outpath)
+		++outpath;
+	else
+		outpath = path;
+	printf("Output file: %s\n", outpath);
+	FILE *out = fopen(outpath, "wb");
+	if (!out)
+	{
+		printf("Cannot create %s file.\n", outpath);
+		fclose(in);
+		return EC_WRERR;
+	}
 
-			// bone bindings
-			fprintf(out, "# bone binding %d %d\n", vtable[6], vtable[7]);
+	int err = convert_obj(in, out);
 
-			// bone weighting
-			unsigned char anchor = vtable[8] & 0x80;
-			unsigned char weight = vtable[8];
-			// get rid of anchor flag, just like in render_bone_frame in render.c
-			// done regardless anchor flag state
-			weight <<= 1;
-			fprintf(out, "# bone weighting %.6f, anchor %d\n", weight / 255.0f, anchor ? 1 : 0);
+	fclose(out);
+	fclose(in);
+	if (err < 0)
+	{
+		printf(err == OBJ_MALFORMED ? "Malformed vertex line in the file.\n" : "Out of memory.\n");
+		return err == OBJ_MALFORMED ? EC_BADFILE : EC_NOOP;
+	}
+	return EC_NONE;
+}
 
-			vtable += 9;
-		}
+void write_obj_base_model(FILE *out, const char *path, unsigned char *ddd, unsigned char *base_model)
+{
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	int header_flags = get_header_flags(ddd);
+	unsigned char *bff = get_bone_frame_filename(ddd);
 
-		// texture vertices
-		int texture_vertex_num = get_texture_vertex_num(base_model);
-		fprintf(out, "# Number of texture vertices: %d\n", texture_vertex_num);
-		unsigned char *tvtable = get_texture_vertices(base_model);
-		for (int j = 0; j < texture_vertex_num; ++j)
-		{
-			float u = (signed short)BE_SHORT(tvtable[0], tvtable[1]) / 256.0f;
-			// note the minus
-			float v = -(signed short)BE_SHORT(tvtable[2], tvtable[3]) / 256.0f;
-			fprintf(out, "vt %.6f %.6f\n", u, v);
-			tvtable += 4;
-		}
+	fprintf(out, "# OBJ file generated from SoulFu DDD file %s\n", path);
+	fprintf(out, "#  Scaling: %.6f\n", scale);
+	fprintf(out, "#  Flags: %04x\n", header_flags);
+	if (bff)
+		fprintf(out, "#  Bone frame filename: %c%c%c%c%c%c%c%c\n",
+			bff[0], bff[1], bff[2], bff[3], bff[4], bff[5], bff[6], bff[7]);
 
-		// faces
-		unsigned char *texture = get_first_texture(base_model);
-		for (int j = 0; j < MAX_DDD_TEXTURE; ++j)
-		{
-			int triangles = get_triangle_num(texture);
-			unsigned char *ttable = get_triangles(texture);
-			if (triangles > 0)
-			{
-				fprintf(out, "# Texture %d\n", j);
-				fprintf(out, "#  Rendering mode: %02x\n", get_rendering_mode(texture));
-				fprintf(out, "#  Flags: %s\n", get_texture_flag_string(get_texture_flags(texture)));
-				fprintf(out, "#  Alpha: %d\n", get_texture_alpha(texture));
-				fprintf(out, "#  Number of triangles: %d\n", triangles);
-				fprintf(out, "usemtl material%d\n", j);
-			}
-			for (int k = 0; k < triangles; ++k)
-			{
-				fprintf(out, "f %d/%d %d/%d %d/%d\n", BE_SHORT(ttable[0], ttable[1]) + 1, BE_SHORT(ttable[2], ttable[3]) + 1,
-					BE_SHORT(ttable[4], ttable[5]) + 1, BE_SHORT(ttable[6], ttable[7]) + 1,
-					BE_SHORT(ttable[8], ttable[9]) + 1, BE_SHORT(ttable[10], ttable[11]) + 1);
-				ttable += 12;
-			}
+	fprintf(out, "#  Number of vertices: %d\n", get_vertex_num(base_model));
 
-			texture = get_next_texture(texture);
-		}
+	fprintf(out, "mtllib materials.mtl\n");
 
-		// joints
-		int joint_num = get_joint_num(base_model);
-		fprintf(out, "# Number of joints: %d\n", joint_num);
-		unsigned char *joints = texture;
-		for (int j = 0; j < joint_num; ++j)
+	// vertices
+	int vertices = get_vertex_num(base_model);
+	unsigned char *vtable = get_vertices(base_model);
+	for (int j = 0; j < vertices; ++j)
+	{
+		float x = (signed short)BE_SHORT(vtable[0], vtable[1]) * scale;
+		float y = (signed short)BE_SHORT(vtable[2], vtable[3]) * scale;
+		float z = (signed short)BE_SHORT(vtable[4], vtable[5]) * scale;
+		fprintf(out, "v %.6f %.6f %.6f\n", x, y, z);
+
+		// bone bindings
+		fprintf(out, "# bone binding %d %d\n", vtable[6], vtable[7]);
+
+		// bone weighting
+		unsigned char anchor = vtable[8] & 0x80;
+		unsigned char weight = vtable[8];
+		// get rid of anchor flag, just like in render_bone_frame in render.c
+		// done regardless anchor flag state
+		weight <<= 1;
+		fprintf(out, "# bone weighting %.6f, anchor %d\n", weight / 255.0f, anchor ? 1 : 0);
+
+		vtable += 9;
+	}
+
+	// texture vertices
+	int texture_vertex_num = get_texture_vertex_num(base_model);
+	fprintf(out, "# Number of texture vertices: %d\n", texture_vertex_num);
+	unsigned char *tvtable = get_texture_vertices(base_model);
+	for (int j = 0; j < texture_vertex_num; ++j)
+	{
+		float u = (signed short)BE_SHORT(tvtable[0], tvtable[1]) / 256.0f;
+		// note the minus
+		float v = -(signed short)BE_SHORT(tvtable[2], tvtable[3]) / 256.0f;
+		fprintf(out, "vt %.6f %.6f\n", u, v);
+		tvtable += 4;
+	}
+
+	// faces
+	unsigned char *texture = get_first_texture(base_model);
+	for (int j = 0; j < MAX_DDD_TEXTURE; ++j)
+	{
+		int triangles = get_triangle_num(texture);
+		unsigned char *ttable = get_triangles(texture);
+		if (triangles > 0)
 		{
-			fprintf(out, "#  Joint %d, size %.6f\n", j, joints[j] * JOINT_COLLISION_SCALE);
+			fprintf(out, "# Texture %d\n", j);
+			fprintf(out, "#  Rendering mode: %02x\n", get_rendering_mode(texture));
+			fprintf(out, "#  Flags: %s\n", get_texture_flag_string(get_texture_flags(texture)));
+			fprintf(out, "#  Alpha: %d\n", get_texture_alpha(texture));
+			fprintf(out, "#  Number of triangles: %d\n", triangles);
+			fprintf(out, "usemtl material%d\n", j);
 		}
-
-		// bones
-		int bone_num = get_bone_num(base_model);
-		fprintf(out, "# Number of bones: %d\n", bone_num);
-		unsigned char *bones = get_bone_data(base_model);
-		for (int j = 0; j < bone_num; ++j)
+		for (int k = 0; k < triangles; ++k)
 		{
-			unsigned char bone_id = bones[0];
-			unsigned short bjoints[2];
-			bjoints[0] = BE_SHORT(bones[1], bones[2]);
-			bjoints[1] = BE_SHORT(bones[3], bones[4]);
-			fprintf(out, "#  Bone %d, id %d, joints %d %d\n", j, bone_id, bjoints[0], bjoints[1]);
-			bones += 5;
+			fprintf(out, "f %d/%d %d/%d %d/%d\n", BE_SHORT(ttable[0], ttable[1]) + 1, BE_SHORT(ttable[2], ttable[3]) + 1,
+				BE_SHORT(ttable[4], ttable[5]) + 1, BE_SHORT(ttable[6], ttable[7]) + 1,
+				BE_SHORT(ttable[8], ttable[9]) + 1, BE_SHORT(ttable[10], ttable[11]) + 1);
+			ttable += 12;
 		}
 
-		fclose(out);
-		printf("Base model %d written to %s.\n", i, filename);
-		base_model = get_next_base_model(base_model);
+		texture = get_next_texture(texture);
 	}
 
-	// add bone frame data to obj models
-	if (!bff)
+	// joints
+	int joint_num = get_joint_num(base_model);
+	fprintf(out, "# Number of joints: %d\n", joint_num);
+	unsigned char *joints = texture;
+	for (int j = 0; j < joint_num; ++j)
 	{
-		unsigned char *bone_frame = get_first_bone_frame(ddd);
-		for (int i = 0; i < bone_frame_num; ++i)
+		fprintf(out, "#  Joint %d, size %.6f\n", j, joints[j] * JOINT_COLLISION_SCALE);
+	}
+
+	// bones
+	int bone_num = get_bone_num(base_model);
+	fprintf(out, "# Number of bones: %d\n", bone_num);
+	unsigned char *bones = get_bone_data(base_model);
+	for (int j = 0; j < bone_num; ++j)
+	{
+		unsigned char bone_id = bones[0];
+		unsigned short bjoints[2];
+		bjoints[0] = BE_SHORT(bones[1], bones[2]);
+		bjoints[1] = BE_SHORT(bones[3], bones[4]);
+		fprintf(out, "#  Bone %d, id %d, joints %d %d\n", j, bone_id, bjoints[0], bjoints[1]);
+		bones += 5;
+	}
+}
+
+void write_obj_bone_frame(FILE *out, unsigned char *ddd, unsigned char *bone_frame, int index)
+{
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	int base_model_id = get_base_model_id(bone_frame);
+
+	fprintf(out, "\n# Bone frame %d\n", index);
+	unsigned char action_id = get_action_name(bone_frame);
+	fprintf(out, "#  Action name: %s (%02x)\n", get_action_string(action_id), action_id);
+	fprintf(out, "#  Action modifier flags: %02x\n", get_action_modifier_flags(bone_frame));
+	unsigned char *xymo = get_xy_movement_offset(bone_frame);
+	float xy_movement_offset[2];
+	xy_movement_offset[0] = (signed short)BE_SHORT(xymo[0], xymo[1]) / 256.0f;
+	xy_movement_offset[1] = (signed short)BE_SHORT(xymo[2], xymo[3]) / 256.0f;
+	fprintf(out, "#  XY movement offset: %.6f, %.6f\n", xy_movement_offset[0], xy_movement_offset[1]);
+
+	unsigned char *bones = get_bones(bone_frame);
+	int bone_num = get_bone_num(get_base_model_from_id(ddd, base_model_id));
+	for (int j = 0; j < bone_num; ++j)
+	{
+		float x = (signed short)BE_SHORT(bones[0], bones[1]);
+		float y = (signed short)BE_SHORT(bones[2], bones[3]);
+		float z = (signed short)BE_SHORT(bones[4], bones[5]);
+		float distance = sqrt(x*x + y*y + z*z);
+		x /= distance;
+		y /= distance;
+		z /= distance;
+		fprintf(out, "#  Bone %d forward normal: %.6f, %.6f, %.6f\n", j, x, y, z);
+		bones += 6;
+	}
+
+	unsigned char *joints = get_joints(ddd, bone_frame);
+	int joint_num = get_joint_num(get_base_model_from_id(ddd, base_model_id));
+	for (int j = 0; j < joint_num; ++j)
+	{
+		float x = (signed short)BE_SHORT(joints[0], joints[1]) * scale;
+		float y = (signed short)BE_SHORT(joints[2], joints[3]) * scale;
+		float z = (signed short)BE_SHORT(joints[4], joints[5]) * scale;
+		fprintf(out, "#  Joint %d: %.6f, %.6f, %.6f\n", j, x, y, z);
+		joints += 6;
+	}
+
+	unsigned char *shadow_texture_data = get_shadow_texture_data(ddd, bone_frame);
+	for (int j = 0; j < MAX_DDD_SHADOW_TEXTURE; ++j)
+	{
+		int alpha = get_shadow_texture_alpha(shadow_texture_data);
+		if (alpha)
 		{
-			int base_model_id = get_base_model_id(bone_frame);
-			sprintf(filename, "model%d.OBJ", base_model_id);
-			FILE *out = fopen(filename, "a");
-			if (!out)
-			{
-				printf("Cannot append to %s file.\n", filename);
-				free(ddd);
-				return EC_WRERR;
-			}
-
-			fprintf(out, "\n# Bone frame %d\n", i);
-			unsigned char action_id = get_action_name(bone_frame);
-			fprintf(out, "#  Action name: %s (%02x)\n", action_strings[action_id], action_id);
-			fprintf(out, "#  Action modifier flags: %02x\n", get_action_modifier_flags(bone_frame));
-			unsigned char *xymo = get_xy_movement_offset(bone_frame);
-			float xy_movement_offset[2];
-			xy_movement_offset[0] = (signed short)BE_SHORT(xymo[0], xymo[1]) / 256.0f;
-			xy_movement_offset[1] = (signed short)BE_SHORT(xymo[2], xymo[3]) / 256.0f;
-			fprintf(out, "#  XY movement offset: %.6f, %.6f\n", xy_movement_offset[0], xy_movement_offset[1]);
-
-			unsigned char *bones = get_bones(bone_frame);
-			int bone_num = get_bone_num(get_base_model_from_id(ddd, base_model_id));
-			for (int j = 0; j < bone_num; ++j)
-			{
-				float x = (signed short)BE_SHORT(bones[0], bones[1]);
-				float y = (signed short)BE_SHORT(bones[2], bones[3]);
-				float z = (signed short)BE_SHORT(bones[4], bones[5]);
-				float distance = sqrt(x*x + y*y + z*z);
-				x /= distance;
-				y /= distance;
-				z /= distance;
-				fprintf(out, "#  Bone %d forward normal: %.6f, %.6f, %.6f\n", j, x, y, z);
-				bones += 6;
-			}
-
-			unsigned char *joints = get_joints(ddd, bone_frame);
-			int joint_num = get_joint_num(get_base_model_from_id(ddd, base_model_id));
-			for (int j = 0; j < joint_num; ++j)
-			{
-				float x = (signed short)BE_SHORT(joints[0], joints[1]) * scale;
-				float y = (signed short)BE_SHORT(joints[2], joints[3]) * scale;
-				float z = (signed short)BE_SHORT(joints[4], joints[5]) * scale;
-				fprintf(out, "#  Joint %d: %.6f, %.6f, %.6f\n", j, x, y, z);
-				joints += 6;
-			}
-
-			unsigned char *shadow_texture_data = get_shadow_texture_data(ddd, bone_frame);
-			for (int j = 0; j < MAX_DDD_SHADOW_TEXTURE; ++j)
+			fprintf(out, "#  Shadow texture %d\n", j);
+			fprintf(out, "#   Alpha: %d\n", alpha);
+			// vertices
+			for (int k = 0; k < 4; ++k)
 			{
-				int alpha = get_shadow_texture_alpha(shadow_texture_data);
-				if (alpha)
-				{
-					fprintf(out, "#  Shadow texture %d\n", j);
-					fprintf(out, "#   Alpha: %d\n", alpha);
-					// vertices
-					for (int k = 0; k < 4; ++k)
-					{
-						float u = (signed short)BE_SHORT(shadow_texture_data[1], shadow_texture_data[2]) * scale;
-						float v = (signed short)BE_SHORT(shadow_texture_data[3], shadow_texture_data[4]) * scale;
-						fprintf(out, "#   Vertex %d: X %.6f, Y %.6f\n", k, u, v);
-					}
-					shadow_texture_data += 17;
-				}
-				else
-				{
-					++shadow_texture_data;
-				}
+				float u = (signed short)BE_SHORT(shadow_texture_data[1], shadow_texture_data[2]) * scale;
+				float v = (signed short)BE_SHORT(shadow_texture_data[3], shadow_texture_data[4]) * scale;
+				fprintf(out, "#   Vertex %d: X %.6f, Y %.6f\n", k, u, v);
 			}
-
-			bone_frame = get_next_bone_frame(ddd, bone_frame);
-			fclose(out);
+			shadow_texture_data += 17;
+		}
+		else
+		{
+			++shadow_texture_data;
 		}
 	}
-
-	free(ddd);
-	return EC_NONE;
 }
 
-int obj_to_ddd(char *path)
+int convert_obj(FILE *in, FILE *out)
 {
-	printf("OBJ to DDD.\n");
+	float scale = 0.001f;
+	float bounds[6];
+	write_ddd_header(out, scale, 1, 1);
+	int vertex_num = write_ddd_base_model(in, out, scale, NULL, bounds);
+	if (vertex_num < 0)
+		return vertex_num;
+	write_ddd_bone_frame(out, scale, 0, bounds);
+	return vertex_num;
+}
 
-	printf("Input file: %s\n", path);
-	FILE *in = fopen(path, "r");
+int pack_obj(const char *outpath, int count, char *paths[])
+{
+	printf("OBJ files to DDD.\n");
 
-	// construct the output path
-	size_t len = strlen(path);
-	path[len - 3] = 'D';
-	path[len - 2] = 'D';
-	path[len - 1] = 'D';
-	const char *outpath = strrchr(path, '/');
-	if (outpath)
-		++outpath;
-	else
-		outpath = path;
-	printf("Output file: %s\n", outpath);
-	FILE *out = fopen(outpath, "wb");
+	// every OBJ file gives one base model, or one per o/g group if it has several
+	static char groups[256][OBJ_GROUP_NAME_SIZE];
+	int sources[256];
+	int base_model_num = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		FILE *in = fopen(paths[i], "r");
+		if (!in)
+		{
+			printf("Cannot load %s file.\n", paths[i]);
+			return EC_NOFILE;
+		}
+		int group_num = list_obj_groups(in, groups + base_model_num, 256 - base_model_num);
+		fclose(in);
+		if (group_num < 0)
+		{
+			printf("Too many base models, 255 at most.\n");
+			return EC_NOARGS;
+		}
+		if (group_num < 2)
+		{
+			groups[base_model_num][0] = 0;
+			group_num = 1;
+		}
+		for (int j = 0; j < group_num; ++j)
+			sources[base_model_num + j] = (group_num > 1 ? 0x10000 : 0) | i;
+		base_model_num += group_num;
+		if (base_model_num > 255)
+		{
+			printf("Too many base models, 255 at most.\n");
+			return EC_NOARGS;
+		}
+	}
+
+	FILE *out = fopen(outpath, "wb+");
+	if (!out)
+	{
+		printf("Cannot create %s file.\n", outpath);
+		return EC_WRERR;
+	}
 
-	// ===> write header
 	float scale = 0.001f;
+	static float bounds[256][6];
+	write_ddd_header(out, scale, base_model_num, base_model_num);
+	for (int i = 0; i < base_model_num; ++i)
+	{
+		const char *path = paths[sources[i] & 0xffff];
+		const char *group = (sources[i] & 0x10000) ? groups[i] : NULL;
+		FILE *in = fopen(path, "r");
+		if (!in)
+		{
+			printf("Cannot load %s file.\n", path);
+			fclose(out);
+			return EC_NOFILE;
+		}
+		int vertex_num = write_ddd_base_model(in, out, scale, group, bounds[i]);
+		fclose(in);
+		if (vertex_num == OBJ_MALFORMED)
+		{
+			printf("Malformed vertex line in %s file.\n", path);
+			fclose(out);
+			return EC_BADFILE;
+		}
+		if (vertex_num < 0)
+		{
+			printf("Out of memory.\n");
+			fclose(out);
+			return EC_NOOP;
+		}
+		printf("Base model %d: %s%s%s, %d vertices\n", i, path, group ? " group " : "", group ? group : "", vertex_num);
+	}
+
+	// one boning frame per base model
+	for (int i = 0; i < base_model_num; ++i)
+		write_ddd_bone_frame(out, scale, i, bounds[i]);
+
+	int err = ferror(out);
+	fclose(out);
+	if (err)
+	{
+		printf("Cannot write %s file.\n", outpath);
+		return EC_WRERR;
+	}
+	printf("Output file: %s\n", outpath);
+	return EC_NONE;
+}
+
+void write_ddd_header(FILE *out, float scale, int base_model_num, int bone_frame_num)
+{
 	fwrite_short(out, (unsigned short)(scale * DDD_SCALE_WEIGHT));	// scale
 	fwrite_short(out, 0xbfff);	// flags
 	fwrite_byte(out, 0);	// padding
-	fwrite_byte(out, 1);	// number of base models
-	fwrite_short(out, 1);	// number of bone frames
+	fwrite_byte(out, base_model_num);	// number of base models
+	fwrite_short(out, bone_frame_num);	// number of bone frames
 
 	// shadow texture indices
 	for (int i = 0; i < MAX_DDD_SHADOW_TEXTURE; ++i)
 		fwrite_byte(out, 0);
 
-	// no external bone frame file, no write
+	// no external bone frame file, no write
+}
+
+// reads the name of the group an "o" or "g" line starts
+static int read_obj_group(FILE *in, const char *cname, char *group)
+{
+	if (strcmp(cname, "o") && strcmp(cname, "g"))
+		return 0;
+
+	char line[OBJ_GROUP_NAME_SIZE] = "";
+	fscanf(in, "%*[ \t]");
+	fscanf(in, "%" OBJ_GROUP_NAME_FORMAT "[^\r\n]", line);
+	strcpy(group, line);
+	return 1;
+}
+
+int list_obj_groups(FILE *in, char (*groups)[OBJ_GROUP_NAME_SIZE], int max)
+{
+	// names of o/g groups that own faces, in order of appearance
+	int group_num = 0;
+	char current[OBJ_GROUP_NAME_SIZE] = "";
+	int listed = 0;
+	fseek(in, 0, SEEK_SET);
+	while (!feof(in))
+	{
+		char cname[160] = "";
+		fscanf(in, "%159s", cname);
+		if (read_obj_group(in, cname, current))
+			listed = 0;
+		else if (!strcmp(cname, "f") && !listed)
+		{
+			listed = 1;
+			int known = 0;
+			for (int i = 0; i < group_num && !known; ++i)
+				known = !strcmp(groups[i], current);
+			if (!known)
+			{
+				if (group_num == max)
+					return -1;
+				strcpy(groups[group_num++], current);
+			}
+		}
+
+		// start at a new line
+		int ch = 0;
+		while ('\n' != ch && EOF != ch)
+		{
+			ch = fgetc(in);
+		}
+	}
+	return group_num;
+}
+
+// reads the coordinates of a "v" or "vt" line, returns 0 for other lines
+// and OBJ_MALFORMED if the numbers are missing
+static int read_obj_vertex(FILE *in, const char *cname, float *coords)
+{
+	if (!strcmp(cname, "v"))
+		return fscanf(in, "%f %f %f", &coords[0], &coords[1], &coords[2]) == 3 ? 'v' : OBJ_MALFORMED;
+	if (!strcmp(cname, "vt"))
+		return fscanf(in, "%f %f", &coords[0], &coords[1]) == 2 ? 't' : OBJ_MALFORMED;
+	return 0;
+}
+
+int write_ddd_base_model(FILE *in, FILE *out, float scale, const char *group, float *bounds)
+{
+	// face indices count every vertex line, so all of them are checked before
+	// anything is written and both passes below read them the same way
+	int *vmap = NULL;
+	int *tvmap = NULL;
+	int obj_vertex_num = 0;
+	int obj_texture_vertex_num = 0;
+	fseek(in, 0, SEEK_SET);
+	while (!feof(in))
+	{
+		char cname[160] = "";
+		float coords[3];
+		fscanf(in, "%159s", cname);
+		int type = read_obj_vertex(in, cname, coords);
+		if (type == OBJ_MALFORMED)
+			return OBJ_MALFORMED;
+		if (type == 'v')
+			++obj_vertex_num;
+		else if (type == 't')
+			++obj_texture_vertex_num;
+		int ch = 0;
+		while ('\n' != ch && EOF != ch)
+			ch = fgetc(in);
+	}
+
+	// with a group, only its faces and the vertices they use are written
+	if (group)
+	{
+		vmap = malloc((obj_vertex_num + 1) * sizeof(*vmap));
+		tvmap = malloc((obj_texture_vertex_num + 1) * sizeof(*tvmap));
+		if (!vmap || !tvmap)
+		{
+			free(vmap);
+			free(tvmap);
+			return -1;
+		}
+		memset(vmap, 0xff, (obj_vertex_num + 1) * sizeof(*vmap));
+		memset(tvmap, 0xff, (obj_texture_vertex_num + 1) * sizeof(*tvmap));
+
+		char current[OBJ_GROUP_NAME_SIZE] = "";
+		fseek(in, 0, SEEK_SET);
+		while (!feof(in))
+		{
+			char cname[160] = "";
+			fscanf(in, "%159s", cname);
+			if (!read_obj_group(in, cname, current) && !strcmp(cname, "f") && !strcmp(current, group))
+			{
+				fscanf(in, "%157[^\n]", cname);
+				cname[strlen(cname) + 1] = '\0'; // double null ends the string
+				char *endptr = cname;
+				int iv, itv;
+				do
+				{
+					endptr = read_triplet(endptr, &iv, &itv, NULL);
+					if (0 == itv) itv = 1;
+					if (iv > 0 && iv <= obj_vertex_num)
+						vmap[iv - 1] = 0;
+					if (iv > 0 && itv <= obj_texture_vertex_num)
+						tvmap[itv - 1] = 0;
+				} while (iv > 0);
+			}
+			int ch = 0;
+			while ('\n' != ch && EOF != ch)
+				ch = fgetc(in);
+		}
+
+		int n = 0;
+		for (int i = 0; i < obj_vertex_num; ++i)
+			if (vmap[i] == 0) vmap[i] = n++;
+		n = 0;
+		for (int i = 0; i < obj_texture_vertex_num; ++i)
+			if (tvmap[i] == 0) tvmap[i] = n++;
+	}
+
+	long int vtv_offset = ftell(out);
+	fwrite_short(out, 0);	// number of vertices - placeholder
+	fwrite_short(out, 0);	// number of texture vertices - placeholder
+	fwrite_short(out, 2);	// number of joints
+	fwrite_short(out, 1);	// number of bones
+
+	// loop over vertices
+	int vertex_num = 0;
+	int obj_vertex = 0;
+	for (int k = 0; k < 3; ++k)
+	{
+		bounds[k] = INFINITY;
+		bounds[k + 3] = -INFINITY;
+	}
+	fseek(in, 0, SEEK_SET);
+	while (!feof(in))
+	{
+		char cname[160] = "";
+		float coords[3];
+		fscanf(in, "%159s", cname);
+		if (read_obj_vertex(in, cname, coords) == 'v' && (!group || vmap[obj_vertex++] >= 0))
+		{
+			float x = coords[0], y = coords[1], z = coords[2];
+			for (int k = 0; k < 3; ++k)
+			{
+				bounds[k] = fminf(bounds[k], coords[k]);
+				bounds[k + 3] = fmaxf(bounds[k + 3], coords[k]);
+			}
+			// coordinates
+			fwrite_short(out, (signed short)(x / scale));
+			fwrite_short(out, (signed short)(y / scale));
+			fwrite_short(out, (signed short)(z / scale));
+			// bone binding
+			fwrite_byte(out, 0);
+			fwrite_byte(out, 0);
+			// bone weighting
+			fwrite_byte(out, (unsigned char)(0.5f * 255.0f) >> 1);
+
+			++vertex_num;
+		}
+
+		// start at a new line
+		int ch = 0;
+		while ('\n' != ch && EOF != ch)
+		{
+			ch = fgetc(in);
+		}
+	}
+
+	if (!vertex_num)
+		memset(bounds, 0, 6 * sizeof(*bounds));
+
+	// loop over texture vertices
+	int texture_vertex_num = 0;
+	int obj_texture_vertex = 0;
+	fseek(in, 0, SEEK_SET);
+	while (!feof(in))
+	{
+		char cname[160] = "";
+		float coords[3];
+		fscanf(in, "%159s", cname);
+		if (read_obj_vertex(in, cname, coords) == 't' && (!group || tvmap[obj_texture_vertex++] >= 0))
+		{
+			float x = coords[0], y = coords[1];
+			// coordinates
+			fwrite_short(out, (signed short)(x * 256.0f));
+			fwrite_short(out, (signed short)(-y * 256.0f));
+
+			++texture_vertex_num;
+		}
+
+		// start at a new line
+		int ch = 0;
+		while ('\n' != ch && EOF != ch)
+		{
+			ch = fgetc(in);
+		}
+	}
+	// write a dummy texture vertex if none exist
+	if (0 == texture_vertex_num)
+	{
+		// coordinates
+		fwrite_short(out, (signed short)(0 * 256.0f));
+		fwrite_short(out, (signed short)(-0 * 256.0f));
+		++texture_vertex_num;
+	}
+
+	// textures
+	long int face_num_offset[MAX_DDD_TEXTURE] = { 0, 0, 0, 0 };
+	int face_num[MAX_DDD_TEXTURE] = { 0, 0, 0, 0 };
+	int current_texture_idx = 0;
+	char texture_started = 0;
+	char current_group[OBJ_GROUP_NAME_SIZE] = "";
+	fseek(in, 0, SEEK_SET);
+	// loop over faces
+	while (!feof(in))
+	{
+		int ix, itx, iy, ity, iz, itz;
+		char cname[160] = "";
+		fscanf(in, "%159s", cname);
+		if (!strcmp(cname, "o") || !strcmp(cname, "g"))
+		{
+			read_obj_group(in, cname, current_group);
+		}
+		else if (!strcmp(cname, "f") && (!group || !strcmp(current_group, group)))
+		{
+			cname[0] = '\0';
+			fscanf(in, "%157[^\n]", cname);
+			cname[strlen(cname) + 1] = '\0'; // double null ends the string
+
+			char *endptr = NULL;
+			endptr = read_triplet(cname, &ix, &itx, NULL);
+			if (0 == itx) itx = 1;
+			endptr = read_triplet(endptr, &iy, &ity, NULL);
+			if (0 == ity) ity = 1;
+			endptr = read_triplet(endptr, &iz, &itz, NULL);
+			if (0 == itz) itz = 1;
+
+			if (!texture_started)
+			{
+				fwrite_byte(out, 1);	// rendering mode on
+				fwrite_byte(out, 0);	// flags
+				fwrite_byte(out, 255);	// alpha
+				face_num_offset[current_texture_idx] = ftell(out);
+				fwrite_short(out, 0);	// number of faces - placeholder
+				texture_started = 1;
+			}
+
+			// three vertex - texture vertex pairs
+			write_ddd_triangle(out, ix, itx, iy, ity, iz, itz, vmap, tvmap, obj_vertex_num, obj_texture_vertex_num);
+
+			++face_num[current_texture_idx];
+
+			// check for n-gons where n > 3
+			// convex only
+			while (iz > 0)
+			{
+				iy = iz;
+				ity = itz;
+				endptr = read_triplet(endptr, &iz, &itz, NULL);
+				if (0 == itz) itz = 1;
+				if (iz > 0)
+				{
+					// three vertex - texture vertex pairs
+					write_ddd_triangle(out, ix, itx, iy, ity, iz, itz, vmap, tvmap, obj_vertex_num, obj_texture_vertex_num);
+
+					++face_num[current_texture_idx];
+				}
+			}
+		}
+		else if (!strcmp(cname, "usemtl") && (!group || !strcmp(current_group, group)))
+		{
+			// materials of other groups do not move the texture of this one
+			if (texture_started && current_texture_idx < (MAX_DDD_TEXTURE - 1))
+			{
+				++current_texture_idx;
+				texture_started = 0;
+			}
+		}
+
+		// start at a new line
+		int ch = 0;
+		while ('\n' != ch && EOF != ch)
+		{
+			ch = fgetc(in);
+		}
+	}
+
+	// rendering mode off for unused textures
+	for (int i = current_texture_idx + texture_started; i < MAX_DDD_TEXTURE; ++i)
+	{
+		fwrite_byte(out, 0);
+	}
+
+	// joints
+	fwrite_byte(out, 0.0f / JOINT_COLLISION_SCALE);
+	fwrite_byte(out, 0.0f / JOINT_COLLISION_SCALE);
+
+	// bones
+	fwrite_byte(out, 0);	// bone id
+	fwrite_short(out, 1);
+	fwrite_short(out, 0);
+
+	// fill out placeholders
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i)
+	{
+		if (face_num_offset[i] != 0)
+		{
+			fseek(out, face_num_offset[i], SEEK_SET);
+			fwrite_short(out, face_num[i]);
+		}
+	}
+	fseek(out, vtv_offset, SEEK_SET);
+	fwrite_short(out, vertex_num);
+	fwrite_short(out, texture_vertex_num);
+	fseek(out, 0, SEEK_END);
+
+	free(vmap);
+	free(tvmap);
+	return vertex_num;
+}
+
+void write_ddd_triangle(FILE *out, int ix, int itx, int iy, int ity, int iz, int itz,
+	const int *vmap, const int *tvmap, int obj_vertex_num, int obj_texture_vertex_num)
+{
+	int v[3] = { ix - 1, iy - 1, iz - 1 };
+	int tv[3] = { itx - 1, ity - 1, itz - 1 };
+	for (int i = 0; i < 3; ++i)
+	{
+		// indices of a group are remapped to the vertices written for it,
+		// texture vertices the file does not have fall back to the dummy one
+		if (vmap)
+			v[i] = v[i] >= 0 && v[i] < obj_vertex_num ? vmap[v[i]] : v[i];
+		if (tvmap)
+			tv[i] = tv[i] >= 0 && tv[i] < obj_texture_vertex_num ? tvmap[tv[i]] : 0;
+		fwrite_short(out, v[i]);
+		fwrite_short(out, tv[i]);
+	}
+}
+
+void write_ddd_bone_frame(FILE *out, float scale, int base_model_id, const float *bounds)
+{
+	// OBJ files have no skeleton, so the boning frame has one bone that runs
+	// from the bottom to the top of the model through the centre of its bounds
+	float x = (bounds[0] + bounds[3]) * 0.5f;
+	float y = (bounds[1] + bounds[4]) * 0.5f;
+
+	fwrite_byte(out, 0);	// action name (0 = boning)
+	fwrite_byte(out, 0);	// action modifier flags
+	fwrite_byte(out, base_model_id);	// base model id
+	fwrite_short(out, 0);	// X movement offset
+	fwrite_short(out, 0);	// Y movement offset
+
+	// 1 bone forward normal
+	fwrite_short(out, 0);	// X
+	fwrite_short(out, -1);	// Y
+	fwrite_short(out, 0);	// Z
+
+	// 2 joints
+	fwrite_short(out, (signed short)(x / scale));	// X
+	fwrite_short(out, (signed short)(y / scale));	// Y
+	fwrite_short(out, (signed short)(bounds[2] / scale));	// Z
+
+	fwrite_short(out, (signed short)(x / scale));	// X
+	fwrite_short(out, (signed short)(y / scale));	// Y
+	fwrite_short(out, (signed short)(bounds[5] / scale));	// Z
+
+	// shadow texture data (alpha only)
+	for (int i = 0; i < MAX_DDD_SHADOW_TEXTURE; ++i)
+		fwrite_byte(out, 0);
+}
+
+int ddd_to_gpu(const char *path)
+{
+	printf("DDD to GPU buffers.\n");
+
+	int err = load_ddd(path);
+	if (err != EC_NONE)
+		return err;
+
+	int ret = EC_NONE;
+	char filename[32];
+	int base_model_num = get_base_model_num(ddd);
+	unsigned char *base_model = get_first_base_model(ddd);
+	for (int i = 0; i < base_model_num; ++i)
+	{
+		sprintf(filename, "model%d.GPU", i);
+		FILE *out = fopen(filename, "wb");
+		if (!out)
+		{
+			printf("Cannot create %s file.\n", filename);
+			ret = EC_WRERR;
+			break;
+		}
+
+		int vertices = write_gpu_base_model(out, ddd, base_model);
+		int err = ferror(out);
+		fclose(out);
+		if (vertices == GPU_TOO_MANY_VERTICES)
+		{
+			printf("Base model %d has more than 65536 distinct vertex/texture vertex pairs, skipped.\n", i);
+			remove(filename);
+			ret = EC_WRERR;
+		}
+		else if (vertices < 0)
+		{
+			printf("Out of memory.\n");
+			remove(filename);
+			ret = EC_NOOP;
+		}
+		else if (err)
+		{
+			printf("Cannot write %s file.\n", filename);
+			ret = EC_WRERR;
+		}
+		else
+		{
+			printf("Base model %d written to %s (%d vertices).\n", i, filename, vertices);
+		}
+		base_model = get_next_base_model(base_model);
+	}
+
+	release_ddd();
+	return ret;
+}
+
+int write_gpu_base_model(FILE *out, unsigned char *ddd, unsigned char *base_model)
+{
+	// DDD triangles index vertices and texture vertices separately, so every
+	// distinct pair becomes one vertex; pairs are mapped through an open
+	// addressing hash table keyed by (vertex << 16 | texture vertex) + 1
+	int corner_num = 0;
+	unsigned char *texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+		corner_num += get_triangle_num(texture) * 3;
+
+	unsigned int capacity = 16;
+	while (capacity < (unsigned int)corner_num * 2)
+		capacity <<= 1;
+	unsigned int *keys = calloc(capacity, sizeof(*keys));
+	unsigned short *values = malloc(capacity * sizeof(*values));
+	unsigned int *pairs = malloc((corner_num + 1) * sizeof(*pairs));
+	unsigned short *indices = malloc((corner_num + 1) * sizeof(*indices));
+	if (!keys || !values || !pairs || !indices)
+	{
+		free(keys);
+		free(values);
+		free(pairs);
+		free(indices);
+		return -1;
+	}
+
+	int vertex_num = 0;
+	int overflow = 0;
+	int corner = 0;
+	texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+	{
+		int triangles = get_triangle_num(texture);
+		unsigned char *ttable = get_triangles(texture);
+		for (int j = 0; j < triangles * 3; ++j, ttable += 4)
+		{
+			unsigned int key = ((unsigned int)BE_SHORT(ttable[0], ttable[1]) << 16 | BE_SHORT(ttable[2], ttable[3])) + 1;
+			unsigned int slot = (key * 2654435761u) & (capacity - 1);
+			while (keys[slot] && keys[slot] != key)
+				slot = (slot + 1) & (capacity - 1);
+			if (!keys[slot])
+			{
+				if (vertex_num == 65536)
+				{
+					overflow = 1;
+					break;
+				}
+				keys[slot] = key;
+				values[slot] = vertex_num;
+				pairs[vertex_num++] = key - 1;
+			}
+			indices[corner++] = values[slot];
+		}
+	}
+
+	if (overflow)
+	{
+		free(keys);
+		free(values);
+		free(pairs);
+		free(indices);
+		return GPU_TOO_MANY_VERTICES;
+	}
+
+	// header
+	fwrite(GPU_MAGIC, 4, 1, out);
+	fwrite_le_int(out, GPU_VERSION);
+	fwrite_le_int(out, vertex_num);
+	fwrite_le_int(out, GPU_VERTEX_SIZE);
+	fwrite_le_int(out, GPU_HEADER_SIZE);	// vertex buffer offset
+	unsigned int offset = GPU_HEADER_SIZE + vertex_num * GPU_VERTEX_SIZE;
+	texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+	{
+		int rendering_mode = get_rendering_mode(texture);
+		int triangles = get_triangle_num(texture);
+		fwrite_byte(out, rendering_mode);
+		fwrite_byte(out, rendering_mode ? get_texture_flags(texture) : 0);
+		fwrite_byte(out, rendering_mode ? get_texture_alpha(texture) : 0);
+		fwrite_byte(out, 0);
+		fwrite_le_int(out, offset);
+		fwrite_le_int(out, triangles * 3);
+		offset += (triangles * 3 * 2 + 3) & ~3;
+	}
+	fwrite_le_int(out, offset);	// total size
+	fwrite_le_int(out, 0);	// reserved
+	fwrite_le_int(out, 0);
+
+	// interleaved vertices
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	unsigned char *vtable = get_vertices(base_model);
+	unsigned char *tvtable = get_texture_vertices(base_model);
+	for (int i = 0; i < vertex_num; ++i)
+	{
+		unsigned char *v = vtable + (pairs[i] >> 16) * 9;
+		unsigned char *tv = tvtable + (pairs[i] & 0xffff) * 4;
+		fwrite_le_float(out, (signed short)BE_SHORT(v[0], v[1]) * scale);
+		fwrite_le_float(out, (signed short)BE_SHORT(v[2], v[3]) * scale);
+		fwrite_le_float(out, (signed short)BE_SHORT(v[4], v[5]) * scale);
+		fwrite_le_float(out, (signed short)BE_SHORT(tv[0], tv[1]) / 256.0f);
+		fwrite_le_float(out, -(signed short)BE_SHORT(tv[2], tv[3]) / 256.0f);
+		fwrite_byte(out, v[6]);	// bone bindings
+		fwrite_byte(out, v[7]);
+		fwrite_byte(out, (unsigned char)(v[8] << 1));	// weight without the anchor flag
+		fwrite_byte(out, v[8] >> 7);	// anchor
+	}
+
+	// index buffers, each padded to 4 bytes
+	corner = 0;
+	texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+	{
+		int count = get_triangle_num(texture) * 3;
+		for (int j = 0; j < count; ++j)
+			fwrite_le_short(out, indices[corner++]);
+		if (count & 1)
+			fwrite_le_short(out, 0);
+	}
+
+	free(keys);
+	free(values);
+	free(pairs);
+	free(indices);
+	return vertex_num;
+}
+
+struct bvh_node
+{
+	float min[3];
+	float max[3];
+	unsigned int left_first;	// left child (right is next) or first triangle of a leaf
+	unsigned int count;	// triangles in a leaf, 0 for interior nodes
+};
+
+struct bvh_build
+{
+	struct bvh_node *nodes;
+	unsigned int node_num;	// allocated atomically, children come in pairs
+	unsigned int *refs;
+	float (*tri_min)[3];
+	float (*tri_max)[3];
+	float (*centroid)[3];
+	int spawn_depth;
+};
+
+struct bvh_task
+{
+	struct bvh_build *build;
+	unsigned int node;
+	int depth;
+};
+
+static float bvh_area(const float *min, const float *max)
+{
+	float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+	return dx * dy + dy * dz + dz * dx;
+}
+
+static void bvh_grow(float *min, float *max, const float *bmin, const float *bmax)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		if (bmin[k] < min[k]) min[k] = bmin[k];
+		if (bmax[k] > max[k]) max[k] = bmax[k];
+	}
+}
+
+static void *bvh_subdivide_task(void *arg);
+
+static void bvh_subdivide(struct bvh_build *build, unsigned int node_id, int depth)
+{
+	struct bvh_node *node = &build->nodes[node_id];
+	unsigned int first = node->left_first;
+	unsigned int count = node->count;
+	if (count <= 1)
+		return;
+
+	// binned SAH over centroid bounds
+	float cmin[3] = { INFINITY, INFINITY, INFINITY };
+	float cmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+	for (unsigned int i = first; i < first + count; ++i)
+		bvh_grow(cmin, cmax, build->centroid[build->refs[i]], build->centroid[build->refs[i]]);
+
+	float best_cost = INFINITY;
+	int best_axis = -1;
+	float best_split = 0.0f;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		float bin_min[BVH_BINS][3], bin_max[BVH_BINS][3];
+		unsigned int bin_count[BVH_BINS] = { 0 };
+		for (int b = 0; b < BVH_BINS; ++b)
+			for (int k = 0; k < 3; ++k)
+			{
+				bin_min[b][k] = INFINITY;
+				bin_max[b][k] = -INFINITY;
+			}
+		float bin_scale = BVH_BINS / extent;
+		for (unsigned int i = first; i < first + count; ++i)
+		{
+			unsigned int t = build->refs[i];
+			int b = (int)((build->centroid[t][axis] - cmin[axis]) * bin_scale);
+			if (b > BVH_BINS - 1) b = BVH_BINS - 1;
+			++bin_count[b];
+			bvh_grow(bin_min[b], bin_max[b], build->tri_min[t], build->tri_max[t]);
+		}
+
+		// sweep from both sides to get the cost of every plane between bins
+		float left_area[BVH_BINS - 1], right_area[BVH_BINS - 1];
+		unsigned int left_count[BVH_BINS - 1], right_count[BVH_BINS - 1];
+		float lmin[3] = { INFINITY, INFINITY, INFINITY }, lmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+		float rmin[3] = { INFINITY, INFINITY, INFINITY }, rmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+		unsigned int lsum = 0, rsum = 0;
+		for (int b = 0; b < BVH_BINS - 1; ++b)
+		{
+			lsum += bin_count[b];
+			left_count[b] = lsum;
+			if (bin_count[b]) bvh_grow(lmin, lmax, bin_min[b], bin_max[b]);
+			left_area[b] = lsum ? bvh_area(lmin, lmax) : 0.0f;
+
+			int rb = BVH_BINS - 1 - b;
+			rsum += bin_count[rb];
+			right_count[rb - 1] = rsum;
+			if (bin_count[rb]) bvh_grow(rmin, rmax, bin_min[rb], bin_max[rb]);
+			right_area[rb - 1] = rsum ? bvh_area(rmin, rmax) : 0.0f;
+		}
+		float node_area = bvh_area(node->min, node->max);
+		for (int b = 0; b < BVH_BINS - 1; ++b)
+		{
+			float cost = BVH_TRAVERSAL_COST * node_area + left_count[b] * left_area[b] + right_count[b] * right_area[b];
+			if (left_count[b] && right_count[b] && cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = cmin[axis] + (b + 1) / bin_scale;
+			}
+		}
+	}
+
+	// a split has to be cheaper than testing every triangle of the node,
+	// unless the leaf would be too large
+	float leaf_cost = count * bvh_area(node->min, node->max);
+	if (best_axis < 0 || (best_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE))
+		return;
+
+	// partition the triangle references
+	unsigned int i = first, j = first + count - 1;
+	while (i <= j && j != (unsigned int)-1)
+	{
+		if (build->centroid[build->refs[i]][best_axis] < best_split)
+			++i;
+		else
+		{
+			unsigned int tmp = build->refs[i];
+			build->refs[i] = build->refs[j];
+			build->refs[j--] = tmp;
+		}
+	}
+	unsigned int left_count = i - first;
+	if (left_count == 0 || left_count == count)
+		return;
+
+	unsigned int left = __atomic_fetch_add(&build->node_num, 2, __ATOMIC_RELAXED);
+	struct bvh_node *children[2] = { &build->nodes[left], &build->nodes[left + 1] };
+	children[0]->left_first = first;
+	children[0]->count = left_count;
+	children[1]->left_first = i;
+	children[1]->count = count - left_count;
+	for (int c = 0; c < 2; ++c)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			children[c]->min[k] = INFINITY;
+			children[c]->max[k] = -INFINITY;
+		}
+		for (unsigned int r = children[c]->left_first; r < children[c]->left_first + children[c]->count; ++r)
+			bvh_grow(children[c]->min, children[c]->max, build->tri_min[build->refs[r]], build->tri_max[build->refs[r]]);
+	}
+	node->left_first = left;
+	node->count = 0;
+
+	// large subtrees near the root are built on their own threads
+	pthread_t thread;
+	struct bvh_task task = { build, left, depth + 1 };
+	int spawned = depth < build->spawn_depth && left_count >= BVH_PARALLEL_SIZE
+		&& !pthread_create(&thread, NULL, bvh_subdivide_task, &task);
+	if (!spawned)
+		bvh_subdivide(build, left, depth + 1);
+	bvh_subdivide(build, left + 1, depth + 1);
+	if (spawned)
+		pthread_join(thread, NULL);
+}
+
+static void *bvh_subdivide_task(void *arg)
+{
+	struct bvh_task *task = arg;
+	bvh_subdivide(task->build, task->node, task->depth);
+	return NULL;
+}
+
+// Child pairs are allocated in whatever order the build threads get to
+// them, so the nodes are renumbered depth first to make the file the same
+// on every run.
+static int bvh_renumber(struct bvh_build *build)
+{
+	struct bvh_node *nodes = malloc(build->node_num * sizeof(*nodes));
+	unsigned int (*stack)[2] = malloc(build->node_num * sizeof(*stack));
+	if (!nodes || !stack)
+	{
+		free(nodes);
+		free(stack);
+		return -1;
+	}
+
+	nodes[0] = build->nodes[0];
+	unsigned int next = 1;
+	int top = 0;
+	stack[top][0] = 0;	// old index
+	stack[top++][1] = 0;	// new index
+	while (top)
+	{
+		--top;
+		unsigned int old = stack[top][0], new = stack[top][1];
+		if (build->nodes[old].count)
+			continue;
+		unsigned int left = build->nodes[old].left_first;
+		nodes[next] = build->nodes[left];
+		nodes[next + 1] = build->nodes[left + 1];
+		nodes[new].left_first = next;
+		// right is pushed first so that the left subtree comes first
+		stack[top][0] = left + 1;
+		stack[top++][1] = next + 1;
+		stack[top][0] = left;
+		stack[top++][1] = next;
+		next += 2;
+	}
+
+	free(stack);
+	free(build->nodes);
+	build->nodes = nodes;
+	return 0;
+}
+
+int ddd_to_bvh(const char *path)
+{
+	printf("DDD to collision BVH.\n");
+
+	int err = load_ddd(path);
+	if (err != EC_NONE)
+		return err;
+
+	int ret = EC_NONE;
+	char filename[32];
+	int base_model_num = get_base_model_num(ddd);
+	unsigned char *base_model = get_first_base_model(ddd);
+	for (int i = 0; i < base_model_num; ++i)
+	{
+		sprintf(filename, "model%d.BVH", i);
+		FILE *out = fopen(filename, "wb");
+		if (!out)
+		{
+			printf("Cannot create %s file.\n", filename);
+			ret = EC_WRERR;
+			break;
+		}
+
+		int node_num = write_bvh_base_model(out, ddd, base_model, i);
+		int err = ferror(out);
+		fclose(out);
+		if (node_num < 0)
+		{
+			printf("Out of memory.\n");
+			ret = EC_NOOP;
+		}
+		else if (err)
+		{
+			printf("Cannot write %s file.\n", filename);
+			ret = EC_WRERR;
+		}
+		else
+		{
+			printf("Base model %d written to %s (%d nodes).\n", i, filename, node_num);
+		}
+		base_model = get_next_base_model(base_model);
+	}
+
+	release_ddd();
+	return ret;
+}
+
+int write_bvh_base_model(FILE *out, unsigned char *ddd, unsigned char *base_model, int base_model_id)
+{
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	int vertex_num = get_vertex_num(base_model);
+	int joint_num = get_joint_num(base_model);
+
+	unsigned int triangle_num = 0;
+	unsigned char *texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+		triangle_num += get_triangle_num(texture);
+
+	struct bvh_build build = { 0 };
+	float (*positions)[3] = malloc((vertex_num + 1) * sizeof(*positions));
+	unsigned short (*triangles)[4] = malloc((triangle_num + 1) * sizeof(*triangles));
+	build.nodes = malloc((triangle_num * 2 + 1) * sizeof(*build.nodes));
+	build.refs = malloc((triangle_num + 1) * sizeof(*build.refs));
+	build.tri_min = malloc((triangle_num + 1) * sizeof(*build.tri_min));
+	build.tri_max = malloc((triangle_num + 1) * sizeof(*build.tri_max));
+	build.centroid = malloc((triangle_num + 1) * sizeof(*build.centroid));
+	float (*joint_min)[3] = malloc((joint_num + 1) * sizeof(*joint_min));
+	float (*joint_max)[3] = malloc((joint_num + 1) * sizeof(*joint_max));
+	int node_num = -1;
+	if (!positions || !triangles || !build.nodes || !build.refs || !build.tri_min || !build.tri_max || !build.centroid
+		|| !joint_min || !joint_max)
+		goto cleanup;
+
+	unsigned char *vtable = get_vertices(base_model);
+	for (int i = 0; i < vertex_num; ++i, vtable += 9)
+		for (int k = 0; k < 3; ++k)
+			positions[i][k] = (signed short)BE_SHORT(vtable[k * 2], vtable[k * 2 + 1]) * scale;
+
+	unsigned int t = 0;
+	texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+	{
+		int count = get_triangle_num(texture);
+		unsigned char *ttable = get_triangles(texture);
+		for (int j = 0; j < count; ++j, ++t, ttable += 12)
+		{
+			for (int c = 0; c < 3; ++c)
+				triangles[t][c] = BE_SHORT(ttable[c * 4], ttable[c * 4 + 1]);
+			triangles[t][3] = i;
+			for (int k = 0; k < 3; ++k)
+			{
+				build.tri_min[t][k] = INFINITY;
+				build.tri_max[t][k] = -INFINITY;
+			}
+			for (int c = 0; c < 3; ++c)
+				bvh_grow(build.tri_min[t], build.tri_max[t], positions[triangles[t][c]], positions[triangles[t][c]]);
+			for (int k = 0; k < 3; ++k)
+				build.centroid[t][k] = (build.tri_min[t][k] + build.tri_max[t][k]) * 0.5f;
+			build.refs[t] = t;
+		}
+	}
+
+	// a base model without triangles has no nodes
+	if (!triangle_num)
+	{
+		build.node_num = 0;
+		goto write;
+	}
+
+	// root
+	struct bvh_node *root = &build.nodes[0];
+	root->left_first = 0;
+	root->count = triangle_num;
+	for (int k = 0; k < 3; ++k)
+	{
+		root->min[k] = triangle_num ? INFINITY : 0.0f;
+		root->max[k] = triangle_num ? -INFINITY : 0.0f;
+	}
+	for (unsigned int i = 0; i < triangle_num; ++i)
+		bvh_grow(root->min, root->max, build.tri_min[i], build.tri_max[i]);
+	build.node_num = 1;
+	int workers = thread_num > 0 ? thread_num : sysconf(_SC_NPROCESSORS_ONLN);
+	while ((1 << build.spawn_depth) < workers)
+		++build.spawn_depth;
+	bvh_subdivide(&build, 0, 0);
+	if (bvh_renumber(&build) < 0)
+		goto cleanup;
+
+write:
+	node_num = build.node_num;
+
+	// joint spheres enclose the collision sphere of a joint in every bone frame of this model
+	int bone_frame_num = get_bone_frame_filename(ddd) ? 0 : get_bone_frame_num(ddd);
+	unsigned char *joint_sizes = get_joint_data(base_model);
+	int posed = 0;
+	for (int j = 0; j < joint_num; ++j)
+		for (int k = 0; k < 3; ++k)
+		{
+			joint_min[j][k] = INFINITY;
+			joint_max[j][k] = -INFINITY;
+		}
+	unsigned char *bone_frame = get_first_bone_frame(ddd);
+	for (int i = 0; i < bone_frame_num; ++i, bone_frame = get_next_bone_frame(ddd, bone_frame))
+	{
+		if (get_base_model_id(bone_frame) != base_model_id)
+			continue;
+		unsigned char *joints = get_joints(ddd, bone_frame);
+		for (int j = 0; j < joint_num; ++j, joints += 6)
+		{
+			float p[3];
+			for (int k = 0; k < 3; ++k)
+				p[k] = (signed short)BE_SHORT(joints[k * 2], joints[k * 2 + 1]) * scale;
+			bvh_grow(joint_min[j], joint_max[j], p, p);
+		}
+		posed = 1;
+	}
+
+	// header
+	unsigned int node_offset = BVH_HEADER_SIZE;
+	unsigned int triangle_offset = node_offset + node_num * 32;
+	unsigned int vertex_offset = triangle_offset + triangle_num * 8;
+	unsigned int joint_offset = vertex_offset + vertex_num * 12;
+	fwrite(BVH_MAGIC, 4, 1, out);
+	fwrite_le_int(out, BVH_VERSION);
+	fwrite_le_int(out, node_num);
+	fwrite_le_int(out, node_offset);
+	fwrite_le_int(out, triangle_num);
+	fwrite_le_int(out, triangle_offset);
+	fwrite_le_int(out, vertex_num);
+	fwrite_le_int(out, vertex_offset);
+	fwrite_le_int(out, joint_num);
+	fwrite_le_int(out, joint_offset);
+	fwrite_le_int(out, joint_offset + joint_num * 20);	// total size
+	fwrite_le_int(out, 0);	// reserved
+
+	for (int i = 0; i < node_num; ++i)
+	{
+		struct bvh_node *node = &build.nodes[i];
+		for (int k = 0; k < 3; ++k)
+			fwrite_le_float(out, node->min[k]);
+		for (int k = 0; k < 3; ++k)
+			fwrite_le_float(out, node->max[k]);
+		fwrite_le_int(out, node->left_first);
+		fwrite_le_int(out, node->count);
+	}
+
+	// triangles in leaf order: 3 vertex indices and the texture
+	for (unsigned int i = 0; i < triangle_num; ++i)
+		for (int c = 0; c < 4; ++c)
+			fwrite_le_short(out, triangles[build.refs[i]][c]);
+
+	for (int i = 0; i < vertex_num; ++i)
+		for (int k = 0; k < 3; ++k)
+			fwrite_le_float(out, positions[i][k]);
+
+	// joint spheres: centre, bounding radius, collision radius
+	for (int j = 0; j < joint_num; ++j)
+	{
+		float size = joint_sizes[j] * JOINT_COLLISION_SCALE;
+		float radius = size;
+		for (int k = 0; k < 3; ++k)
+		{
+			float centre = posed ? (joint_min[j][k] + joint_max[j][k]) * 0.5f : 0.0f;
+			fwrite_le_float(out, centre);
+		}
+		if (posed)
+		{
+			float dx = joint_max[j][0] - joint_min[j][0];
+			float dy = joint_max[j][1] - joint_min[j][1];
+			float dz = joint_max[j][2] - joint_min[j][2];
+			radius += sqrtf(dx * dx + dy * dy + dz * dz) * 0.5f;
+		}
+		fwrite_le_float(out, radius);
+		fwrite_le_float(out, size);
+	}
+
+cleanup:
+	free(positions);
+	free(triangles);
+	free(build.nodes);
+	free(build.refs);
+	free(build.tri_min);
+	free(build.tri_max);
+	free(build.centroid);
+	free(joint_min);
+	free(joint_max);
+	return node_num;
+}
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+
+struct preview_triangle
+{
+	float x[3], y[3], z[3];
+	float u[3], v[3];
+	float shade;
+	unsigned char color[3];
+	unsigned char alpha;
+};
+
+struct preview_image
+{
+	int size;
+	int tiles;	// per side
+	struct preview_triangle *triangles;
+	int triangle_num;
+	int **bins;	// triangle ids per tile, opaque textures first
+	int *bin_num;
+	unsigned char *rgba;
+	float *depth;
+	int next_tile;
+	pthread_mutex_t mutex;
+};
+
+static const unsigned char preview_palette[MAX_DDD_TEXTURE][3] = {
+	{ 200, 170, 130 }, { 120, 160, 210 }, { 150, 200, 120 }, { 210, 120, 140 }
+};
+
+static void preview_rasterize(struct preview_image *image, int tile)
+{
+	int size = image->size;
+	int tx = (tile % image->tiles) * PREVIEW_TILE_SIZE;
+	int ty = (tile / image->tiles) * PREVIEW_TILE_SIZE;
+	int tx1 = tx + PREVIEW_TILE_SIZE < size ? tx + PREVIEW_TILE_SIZE : size;
+	int ty1 = ty + PREVIEW_TILE_SIZE < size ? ty + PREVIEW_TILE_SIZE : size;
+	const v4sf lane = { 0.5f, 1.5f, 2.5f, 3.5f };
+
+	for (int b = 0; b < image->bin_num[tile]; ++b)
+	{
+		struct preview_triangle *t = &image->triangles[image->bins[tile][b]];
+
+		// edge functions, oriented so that inside is positive
+		float area = (t->x[1] - t->x[0]) * (t->y[2] - t->y[0]) - (t->x[2] - t->x[0]) * (t->y[1] - t->y[0]);
+		if (area == 0.0f)
+			continue;
+		float sign = area > 0.0f ? 1.0f : -1.0f;
+		float ea[3], eb[3], ec[3];
+		for (int e = 0; e < 3; ++e)
+		{
+			int i = (e + 1) % 3, j = (e + 2) % 3;
+			ea[e] = (t->y[i] - t->y[j]) * sign;
+			eb[e] = (t->x[j] - t->x[i]) * sign;
+			ec[e] = (t->x[i] * t->y[j] - t->x[j] * t->y[i]) * sign;
+		}
+		float inv_area = 1.0f / (area * sign);
+
+		float fx0 = fminf(fminf(t->x[0], t->x[1]), t->x[2]);
+		float fx1 = fmaxf(fmaxf(t->x[0], t->x[1]), t->x[2]);
+		float fy0 = fminf(fminf(t->y[0], t->y[1]), t->y[2]);
+		float fy1 = fmaxf(fmaxf(t->y[0], t->y[1]), t->y[2]);
+		int x0 = fx0 > tx ? (int)fx0 : tx;
+		int x1 = fx1 + 1 < tx1 ? (int)fx1 + 1 : tx1;
+		int y0 = fy0 > ty ? (int)fy0 : ty;
+		int y1 = fy1 + 1 < ty1 ? (int)fy1 + 1 : ty1;
+		x0 &= ~3;
+
+		for (int y = y0; y < y1; ++y)
+		{
+			float py = y + 0.5f;
+			for (int x = x0; x < x1; x += 4)
+			{
+				// four pixels at a time
+				v4sf px = lane + (float)x;
+				v4sf w[3];
+				for (int e = 0; e < 3; ++e)
+					w[e] = px * ea[e] + (eb[e] * py + ec[e]);
+				v4si inside = (w[0] >= 0.0f) & (w[1] >= 0.0f) & (w[2] >= 0.0f);
+				if (!(inside[0] | inside[1] | inside[2] | inside[3]))
+					continue;
+
+				for (int l = 0; l < 4; ++l)
+				{
+					int sx = x + l;
+					if (!inside[l] || sx < tx || sx >= x1)
+						continue;
+					float b0 = w[0][l] * inv_area, b1 = w[1][l] * inv_area, b2 = w[2][l] * inv_area;
+					float z = b0 * t->z[0] + b1 * t->z[1] + b2 * t->z[2];
+					float *depth = &image->depth[y * size + sx];
+					if (z >= *depth)
+						continue;
+
+					// UV checker stands in for the texture, which is not part of the DDD
+					float u = b0 * t->u[0] + b1 * t->u[1] + b2 * t->u[2];
+					float v = b0 * t->v[0] + b1 * t->v[1] + b2 * t->v[2];
+					float checker = (((int)floorf(u * 8.0f) + (int)floorf(v * 8.0f)) & 1) ? 1.0f : 0.8f;
+					float k = checker * t->shade;
+					unsigned char *dst = &image->rgba[(y * size + sx) * 4];
+					if (t->alpha == 255)
+					{
+						*depth = z;
+						for (int c = 0; c < 3; ++c)
+							dst[c] = fminf(t->color[c] * k, 255.0f);
+						dst[3] = 255;
+					}
+					else
+					{
+						float a = t->alpha / 255.0f;
+						for (int c = 0; c < 3; ++c)
+							dst[c] = fminf(t->color[c] * k * a + dst[c] * (1.0f - a), 255.0f);
+						dst[3] = dst[3] + (255 - dst[3]) * a;
+					}
+				}
+			}
+		}
+	}
+}
+
+static void *preview_tile_worker(void *arg)
+{
+	struct preview_image *image = arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&image->mutex);
+		int tile = image->next_tile++;
+		pthread_mutex_unlock(&image->mutex);
+		if (tile >= image->tiles * image->tiles)
+			break;
+		preview_rasterize(image, tile);
+	}
+	return NULL;
+}
+
+// renders a base model with a fixed three quarter view, returns RGBA pixels
+static unsigned char *preview_base_model(unsigned char *ddd, unsigned char *base_model, int size, int workers)
+{
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	int vertex_num = get_vertex_num(base_model);
+	int texture_vertex_num = get_texture_vertex_num(base_model);
+
+	struct preview_image image = { 0 };
+	image.size = size;
+	image.tiles = (size + PREVIEW_TILE_SIZE - 1) / PREVIEW_TILE_SIZE;
+	pthread_mutex_init(&image.mutex, NULL);
+	unsigned char *texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+		image.triangle_num += get_triangle_num(texture);
+
+	float (*screen)[3] = malloc((vertex_num + 1) * sizeof(*screen));
+	image.triangles = malloc((image.triangle_num + 1) * sizeof(*image.triangles));
+	image.bins = calloc(image.tiles * image.tiles, sizeof(*image.bins));
+	image.bin_num = calloc(image.tiles * image.tiles, sizeof(*image.bin_num));
+	int *bin_capacity = calloc(image.tiles * image.tiles, sizeof(*bin_capacity));
+	image.rgba = calloc((size_t)size * size, 4);
+	image.depth = malloc((size_t)size * size * sizeof(*image.depth));
+	int ok = screen && image.triangles && image.bins && image.bin_num && bin_capacity && image.rgba && image.depth;
+
+	// view: rotate 45 degrees around Z (up), then tilt down 30 degrees
+	const float cz = 0.70710678f, sz = 0.70710678f, cx = 0.8660254f, sx = 0.5f;
+	float min[2] = { INFINITY, INFINITY }, max[2] = { -INFINITY, -INFINITY };
+	unsigned char *vtable = get_vertices(base_model);
+	for (int i = 0; ok && i < vertex_num; ++i, vtable += 9)
+	{
+		float x = (signed short)BE_SHORT(vtable[0], vtable[1]) * scale;
+		float y = (signed short)BE_SHORT(vtable[2], vtable[3]) * scale;
+		float z = (signed short)BE_SHORT(vtable[4], vtable[5]) * scale;
+		float rx = x * cz - y * sz;
+		float ry = x * sz + y * cz;
+		screen[i][0] = rx;
+		screen[i][1] = -(z * cx + ry * sx);	// screen Y goes down
+		screen[i][2] = ry * cx - z * sx;	// distance from the viewer
+		for (int k = 0; k < 2; ++k)
+		{
+			if (screen[i][k] < min[k]) min[k] = screen[i][k];
+			if (screen[i][k] > max[k]) max[k] = screen[i][k];
+		}
+	}
+
+	// fit into the image with a margin
+	float extent = fmaxf(max[0] - min[0], max[1] - min[1]);
+	float fit = extent > 0.0f ? size * 0.9f / extent : 1.0f;
+	for (int i = 0; ok && i < vertex_num; ++i)
+	{
+		screen[i][0] = (screen[i][0] - (min[0] + max[0]) * 0.5f) * fit + size * 0.5f;
+		screen[i][1] = (screen[i][1] - (min[1] + max[1]) * 0.5f) * fit + size * 0.5f;
+	}
+
+	// set up triangles of opaque textures first, so blended ones land on top
+	int triangle = 0;
+	unsigned char *tvtable = get_texture_vertices(base_model);
+	for (int pass = 0; ok && pass < 2; ++pass)
+	{
+		texture = get_first_texture(base_model);
+		for (int j = 0; j < MAX_DDD_TEXTURE; ++j, texture = get_next_texture(texture))
+		{
+			int triangles = get_triangle_num(texture);
+			if (!triangles || (get_texture_alpha(texture) == 255) != (pass == 0))
+				continue;
+			unsigned char flags = get_texture_flags(texture);
+			unsigned char *ttable = get_triangles(texture);
+			for (int k = 0; k < triangles; ++k, ttable += 12)
+			{
+				struct preview_triangle *t = &image.triangles[triangle];
+				float world[3][3];
+				for (int c = 0; c < 3; ++c)
+				{
+					int v = BE_SHORT(ttable[c * 4], ttable[c * 4 + 1]);
+					int tv = BE_SHORT(ttable[c * 4 + 2], ttable[c * 4 + 3]);
+					t->x[c] = screen[v][0];
+					t->y[c] = screen[v][1];
+					t->z[c] = screen[v][2];
+					unsigned char *vt = get_vertices(base_model) + v * 9;
+					for (int d = 0; d < 3; ++d)
+						world[c][d] = (signed short)BE_SHORT(vt[d * 2], vt[d * 2 + 1]);
+					t->u[c] = tv < texture_vertex_num ? (signed short)BE_SHORT(tvtable[tv * 4], tvtable[tv * 4 + 1]) / 256.0f : 0.0f;
+					t->v[c] = tv < texture_vertex_num ? (signed short)BE_SHORT(tvtable[tv * 4 + 2], tvtable[tv * 4 + 3]) / 256.0f : 0.0f;
+				}
+
+				// back faces have clockwise screen winding
+				float area = (t->x[1] - t->x[0]) * (t->y[2] - t->y[0]) - (t->x[2] - t->x[0]) * (t->y[1] - t->y[0]);
+				if (!(flags & RENDER_NOCULL_FLAG) && area > 0.0f)
+					continue;
+
+				// Lambert shading from the world space normal
+				float e1[3], e2[3], n[3];
+				for (int d = 0; d < 3; ++d)
+				{
+					e1[d] = world[1][d] - world[0][d];
+					e2[d] = world[2][d] - world[0][d];
+				}
+				n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+				n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+				n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+				float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				float ndotl = len > 0.0f ? fabsf(n[0] * 0.3f + n[1] * -0.5f + n[2] * 0.81f) / len : 1.0f;
+				t->shade = (flags & RENDER_LIGHT_FLAG) ? 0.35f + 0.65f * ndotl : 1.0f;
+				if (flags & RENDER_ENVIRO_FLAG)
+					t->shade += 0.3f * ndotl * ndotl;
+				for (int c = 0; c < 3; ++c)
+					t->color[c] = (flags & RENDER_COLOR_FLAG) ? 230 : preview_palette[j][c];
+				t->alpha = get_texture_alpha(texture);
+
+				// bin into the tiles its bounding box touches
+				int bx0 = (int)fmaxf(fminf(fminf(t->x[0], t->x[1]), t->x[2]), 0.0f) / PREVIEW_TILE_SIZE;
+				int bx1 = (int)fminf(fmaxf(fmaxf(t->x[0], t->x[1]), t->x[2]), size - 1) / PREVIEW_TILE_SIZE;
+				int by0 = (int)fmaxf(fminf(fminf(t->y[0], t->y[1]), t->y[2]), 0.0f) / PREVIEW_TILE_SIZE;
+				int by1 = (int)fminf(fmaxf(fmaxf(t->y[0], t->y[1]), t->y[2]), size - 1) / PREVIEW_TILE_SIZE;
+				for (int by = by0; ok && by <= by1; ++by)
+				{
+					for (int bx = bx0; bx <= bx1; ++bx)
+					{
+						int tile = by * image.tiles + bx;
+						if (image.bin_num[tile] == bin_capacity[tile])
+						{
+							bin_capacity[tile] = bin_capacity[tile] ? bin_capacity[tile] * 2 : 64;
+							int *bin = realloc(image.bins[tile], bin_capacity[tile] * sizeof(*bin));
+							if (!bin)
+							{
+								ok = 0;
+								break;
+							}
+							image.bins[tile] = bin;
+						}
+						image.bins[tile][image.bin_num[tile]++] = triangle;
+					}
+				}
+				++triangle;
+			}
+		}
+	}
+
+	if (ok)
+	{
+		for (size_t i = 0; i < (size_t)size * size; ++i)
+			image.depth[i] = INFINITY;
+
+		pthread_t threads[64];
+		int started = 0;
+		for (; started < workers - 1 && started < 64; ++started)
+			if (pthread_create(&threads[started], NULL, preview_tile_worker, &image))
+				break;
+		preview_tile_worker(&image);
+		for (int i = 0; i < started; ++i)
+			pthread_join(threads[i], NULL);
+	}
+
+	for (int i = 0; image.bins && i < image.tiles * image.tiles; ++i)
+		free(image.bins[i]);
+	free(image.bins);
+	free(image.bin_num);
+	free(bin_capacity);
+	free(image.depth);
+	free(image.triangles);
+	free(screen);
+	if (!ok)
+	{
+		free(image.rgba);
+		return NULL;
+	}
+	return image.rgba;
+}
+
+struct preview_job
+{
+	struct io_batch *io;
+	int size;
+	int tile_workers;
+	int failed;
+	pthread_mutex_t mutex;
+};
+
+// validates a file read by a batch worker without holding the lock of the
+// job, its messages are collected and printed in one piece
+static int validate_batch_file(pthread_mutex_t *mutex, const char *path, const unsigned char *data, size_t size)
+{
+	char *log = NULL;
+	size_t log_size = 0;
+	FILE *out = open_memstream(&log, &log_size);
+	int errors = out ? validate_ddd(out, path, data, size) : 0;
+	if (out)
+		fclose(out);
+
+	pthread_mutex_lock(mutex);
+	if (out)
+		fwrite(log, 1, log_size, stdout);
+	else
+		errors = validate_ddd(stdout, path, data, size);
+	pthread_mutex_unlock(mutex);
+	free(log);
+	return errors;
+}
+
+static void *preview_worker(void *arg)
+{
+	struct preview_job *job = arg;
+	struct io_file file;
+	while (io_batch_next(job->io, &file))
+	{
+		const char *path = file.path;
+		unsigned char *ddd = file.data;
+		int failed = file.error != 0;
+		if (failed)
+		{
+			pthread_mutex_lock(&job->mutex);
+			printf("%s: cannot load the file\n", path);
+			pthread_mutex_unlock(&job->mutex);
+		}
+		else
+			failed = validate_batch_file(&job->mutex, path, ddd, file.size) > 0;
+
+		// images are written next to the input file and named after it, so
+		// files of the same name from different directories do not collide
+		const char *name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+		const char *ext = strrchr(name, '.');
+		int stem_len = ext ? ext - path : (int)strlen(path);
+
+		int base_model_num = failed ? 0 : get_base_model_num(ddd);
+		unsigned char *base_model = failed ? NULL : get_first_base_model(ddd);
+		for (int j = 0; j < base_model_num; ++j, base_model = get_next_base_model(base_model))
+		{
+			char filename[PATH_MAX];
+			snprintf(filename, sizeof(filename), "%.*s_%d.png", stem_len, path, j);
+			// images are encoded here and written by the I/O stage
+			unsigned char *rgba = preview_base_model(ddd, base_model, job->size, job->tile_workers);
+			char *png = NULL;
+			size_t png_size = 0;
+			FILE *out = rgba ? open_memstream(&png, &png_size) : NULL;
+			int err = !out || write_png(out, rgba, job->size, job->size) < 0;
+			if (out && fclose(out))
+				err = 1;
+			if (!err)
+				err = io_batch_write(job->io, filename, (unsigned char *)png, png_size) < 0;
+			else
+				free(png);
+			free(rgba);
+
+			pthread_mutex_lock(&job->mutex);
+			if (err)
+				printf("%s: cannot write %s\n", path, filename);
+			else
+				printf("%s: base model %d rendered as %s\n", path, j, filename);
+			pthread_mutex_unlock(&job->mutex);
+			failed |= err;
+		}
+		free(ddd);
+
+		if (failed)
+		{
+			pthread_mutex_lock(&job->mutex);
+			++job->failed;
+			pthread_mutex_unlock(&job->mutex);
+		}
+	}
+	return NULL;
+}
+
+int preview_files(int count, char *paths[], int size)
+{
+	printf("DDD previews.\n");
+
+	// files are spread over the workers, tiles of one image only when there are fewer files
+	int workers = thread_num > 0 ? thread_num : sysconf(_SC_NPROCESSORS_ONLN);
+	int file_workers = workers < count ? workers : count;
+	struct preview_job job = { io_batch_open(count, paths), size, workers / file_workers, 0, PTHREAD_MUTEX_INITIALIZER };
+	if (!job.io)
+	{
+		printf("Cannot start file I/O.\n");
+		return EC_NOFILE;
+	}
+
+	pthread_t *threads = malloc(file_workers * sizeof(*threads));
+	int started = 0;
+	for (; threads && started < file_workers - 1; ++started)
+		if (pthread_create(&threads[started], NULL, preview_worker, &job))
+			break;
+	preview_worker(&job);
+	for (int i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	int write_failed = io_batch_close(job.io);
+
+	printf("%d of %d files rendered.\n", count - job.failed, count);
+	if (write_failed)
+		printf("%d images could not be written.\n", write_failed);
+	return job.failed || write_failed ? EC_WRERR : EC_NONE;
+}
+
+static unsigned int png_crc_table[256];
+
+static void png_crc_init(void)
+{
+	for (unsigned int n = 0; n < 256; ++n)
+	{
+		unsigned int c = n;
+		for (int k = 0; k < 8; ++k)
+			c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		png_crc_table[n] = c;
+	}
+}
+
+static unsigned int png_crc(unsigned int crc, const unsigned char *data, size_t size)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, png_crc_init);
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = png_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void png_chunk(FILE *out, const char *type, const unsigned char *data, size_t size)
+{
+	unsigned char header[8] = { size >> 24, size >> 16, size >> 8, size, type[0], type[1], type[2], type[3] };
+	fwrite(header, 8, 1, out);
+	if (size)
+		fwrite(data, size, 1, out);
+	unsigned int crc = png_crc(png_crc(0, header + 4, 4), data, size);
+	unsigned char footer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+	fwrite(footer, 4, 1, out);
+}
+
+int write_png(FILE *out, const unsigned char *rgba, int width, int height)
+{
+	// rows with filter type 0 in front of each
+	size_t row = (size_t)width * 4 + 1;
+	size_t raw_size = row * height;
+	unsigned char *raw = malloc(raw_size);
+	if (!raw)
+		return -1;
+	for (int y = 0; y < height; ++y)
+	{
+		raw[y * row] = 0;
+		memcpy(raw + y * row + 1, rgba + (size_t)y * width * 4, width * 4);
+	}
+
+#ifdef HAVE_ZLIB
+	uLongf data_size = compressBound(raw_size);
+	unsigned char *data = malloc(data_size);
+	if (!data || compress2(data, &data_size, raw, raw_size, 6) != Z_OK)
+	{
+		free(data);
+		free(raw);
+		return -1;
+	}
+#else
+	// zlib stream of stored blocks
+	size_t blocks = (raw_size + 65534) / 65535;
+	size_t data_size = 2 + raw_size + blocks * 5 + 4;
+	unsigned char *data = malloc(data_size);
+	if (!data)
+	{
+		free(raw);
+		return -1;
+	}
+	unsigned char *p = data;
+	*p++ = 0x78;
+	*p++ = 0x01;
+	unsigned int a = 1, b = 0;
+	for (size_t i = 0; i < raw_size; i += 65535)
+	{
+		size_t n = raw_size - i < 65535 ? raw_size - i : 65535;
+		*p++ = i + n == raw_size;
+		*p++ = n & 0xff;
+		*p++ = n >> 8;
+		*p++ = ~n & 0xff;
+		*p++ = (~n >> 8) & 0xff;
+		memcpy(p, raw + i, n);
+		p += n;
+		for (size_t j = 0; j < n; ++j)
+		{
+			a = (a + raw[i + j]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+	unsigned int adler = b << 16 | a;
+	*p++ = adler >> 24;
+	*p++ = adler >> 16;
+	*p++ = adler >> 8;
+	*p++ = adler;
+#endif
+	free(raw);
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite(signature, 8, 1, out);
+	unsigned char ihdr[13] = { width >> 24, width >> 16, width >> 8, width, height >> 24, height >> 16, height >> 8, height,
+		8, 6, 0, 0, 0 };	// 8 bit RGBA
+	png_chunk(out, "IHDR", ihdr, 13);
+	png_chunk(out, "IDAT", data, data_size);
+	png_chunk(out, "IEND", NULL, 0);
+	free(data);
+
+	// the stream belongs to the caller, which closes it on every path
+	return ferror(out) ? -1 : 0;
+}
+
+struct stats_job
+{
+	struct io_batch *io;
+	char **reports;	// JSON object per file
+	size_t *report_sizes;
+	int failed;
+	pthread_mutex_t mutex;
+};
+
+typedef short v8hi __attribute__((vector_size(16)));
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+
+// smallest and largest of 16-bit values, eight lanes at a time
+static void stats_range(const short *values, int count, int *min, int *max)
+{
+	v8hi vmin = { 32767, 32767, 32767, 32767, 32767, 32767, 32767, 32767 };
+	v8hi vmax = { -32768, -32768, -32768, -32768, -32768, -32768, -32768, -32768 };
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		v8hi v;
+		memcpy(&v, values + i, sizeof(v));
+		v8hi less = v < vmin, more = v > vmax;
+		vmin = (v & less) | (vmin & ~less);
+		vmax = (v & more) | (vmax & ~more);
+	}
+	int lo = 32767, hi = -32768;
+	for (int k = 0; k < 8; ++k)
+	{
+		lo = vmin[k] < lo ? vmin[k] : lo;
+		hi = vmax[k] > hi ? vmax[k] : hi;
+	}
+	for (; i < count; ++i)
+	{
+		lo = values[i] < lo ? values[i] : lo;
+		hi = values[i] > hi ? values[i] : hi;
+	}
+	*min = lo;
+	*max = hi;
+}
+
+// UVs outside 0..1 (256 in DDD units), V is stored negated
+static int stats_uv_out(const short *u, const short *v, int count)
+{
+	v8hi counts = { 0 };
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		v8hi vu, vv;
+		memcpy(&vu, u + i, sizeof(vu));
+		memcpy(&vv, v + i, sizeof(vv));
+		// a lane is -1 where the UV is out of range, at most 8192 steps per lane
+		counts += (vu < 0) | (vu > 256) | (vv > 0) | (vv < -256);
+	}
+	int out = 0;
+	for (int k = 0; k < 8; ++k)
+		out -= counts[k];
+	for (; i < count; ++i)
+		out += u[i] < 0 || u[i] > 256 || v[i] > 0 || v[i] < -256;
+	return out;
+}
+
+// number of zero bytes, sixteen lanes at a time
+static int stats_zeros(const unsigned char *values, int count)
+{
+	int zeros = 0;
+	int i = 0;
+	while (i + 16 <= count)
+	{
+		// byte lanes are flushed before they can wrap
+		v16qu counts = { 0 };
+		for (int block = 0; block < 255 && i + 16 <= count; ++block, i += 16)
+		{
+			v16qu v;
+			memcpy(&v, values + i, sizeof(v));
+			counts -= (v16qu)(v == 0);
+		}
+		for (int k = 0; k < 16; ++k)
+			zeros += counts[k];
+	}
+	for (; i < count; ++i)
+		zeros += !values[i];
+	return zeros;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+void write_stats_base_model(FILE *out, unsigned char *ddd, unsigned char *base_model)
+{
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	int vertex_num = get_vertex_num(base_model);
+	int texture_vertex_num = get_texture_vertex_num(base_model);
+
+	// decode into plain arrays for the vector reductions below
+	short *coords = malloc(((size_t)vertex_num * 3 + (size_t)texture_vertex_num * 2 + 1) * sizeof(*coords));
+	short *vx = coords, *vy = coords + vertex_num, *vz = coords + vertex_num * 2;
+	short *tu = coords + vertex_num * 3, *tv = tu + texture_vertex_num;
+	int triangle_num = 0;
+	unsigned char *texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+		triangle_num += get_triangle_num(texture);
+	unsigned long long *keys = malloc((triangle_num + 1) * sizeof(*keys));
+	unsigned char *used = calloc(vertex_num + texture_vertex_num + 1, 1);
+	if (!coords || !keys || !used)
+	{
+		fprintf(out, "{\"error\":\"out of memory\"}");
+		free(coords);
+		free(keys);
+		free(used);
+		return;
+	}
+
+	unsigned char *vtable = get_vertices(base_model);
+	for (int i = 0; i < vertex_num; ++i, vtable += 9)
+	{
+		vx[i] = BE_SHORT(vtable[0], vtable[1]);
+		vy[i] = BE_SHORT(vtable[2], vtable[3]);
+		vz[i] = BE_SHORT(vtable[4], vtable[5]);
+	}
+	unsigned char *tvtable = get_texture_vertices(base_model);
+	for (int i = 0; i < texture_vertex_num; ++i, tvtable += 4)
+	{
+		tu[i] = BE_SHORT(tvtable[0], tvtable[1]);
+		tv[i] = BE_SHORT(tvtable[2], tvtable[3]);
+	}
+
+	int min[3], max[3];
+	int abs_max = 0;
+	stats_range(vx, vertex_num, &min[0], &max[0]);
+	stats_range(vy, vertex_num, &min[1], &max[1]);
+	stats_range(vz, vertex_num, &min[2], &max[2]);
+	for (int k = 0; k < 3 && vertex_num; ++k)
+	{
+		abs_max = -min[k] > abs_max ? -min[k] : abs_max;
+		abs_max = max[k] > abs_max ? max[k] : abs_max;
+	}
+
+	int uv_out = stats_uv_out(tu, tv, texture_vertex_num), uv_abs_max = 0;
+	for (int k = 0; k < 2 && texture_vertex_num; ++k)
+	{
+		int lo, hi;
+		stats_range(k ? tv : tu, texture_vertex_num, &lo, &hi);
+		uv_abs_max = -lo > uv_abs_max ? -lo : uv_abs_max;
+		uv_abs_max = hi > uv_abs_max ? hi : uv_abs_max;
+	}
+
+	// triangles: area, degenerates and sorted index keys for duplicates
+	double area = 0.0;
+	int degenerate = 0;
+	int t = 0;
+	texture = get_first_texture(base_model);
+	for (int i = 0; i < MAX_DDD_TEXTURE; ++i, texture = get_next_texture(texture))
+	{
+		int triangles = get_triangle_num(texture);
+		unsigned char *ttable = get_triangles(texture);
+		for (int j = 0; j < triangles; ++j, ++t, ttable += 12)
+		{
+			unsigned int a = BE_SHORT(ttable[0], ttable[1]);
+			unsigned int b = BE_SHORT(ttable[4], ttable[5]);
+			unsigned int c = BE_SHORT(ttable[8], ttable[9]);
+			used[a] = used[b] = used[c] = 1;
+			used[vertex_num + BE_SHORT(ttable[2], ttable[3])] = 1;
+			used[vertex_num + BE_SHORT(ttable[6], ttable[7])] = 1;
+			used[vertex_num + BE_SHORT(ttable[10], ttable[11])] = 1;
+
+			long long e1[3] = { vx[b] - vx[a], vy[b] - vy[a], vz[b] - vz[a] };
+			long long e2[3] = { vx[c] - vx[a], vy[c] - vy[a], vz[c] - vz[a] };
+			long long n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+			if (a == b || b == c || a == c || (!n[0] && !n[1] && !n[2]))
+				++degenerate;
+			area += 0.5 * sqrt((double)n[0] * n[0] + (double)n[1] * n[1] + (double)n[2] * n[2]);
+
+			unsigned int s0 = a < b ? a : b, s1 = a < b ? b : a, s2 = c;
+			if (s2 < s1) { unsigned int x = s1; s1 = s2; s2 = x; }
+			if (s1 < s0) { unsigned int x = s0; s0 = s1; s1 = x; }
+			keys[t] = (unsigned long long)s0 << 32 | (unsigned long long)s1 << 16 | s2;
+		}
+	}
+	qsort(keys, triangle_num, sizeof(*keys), compare_ull);
+	int duplicate = 0;
+	for (int i = 1; i < triangle_num; ++i)
+		duplicate += keys[i] == keys[i - 1];
+
+	int unused_vertices = stats_zeros(used, vertex_num);
+	int unused_texture_vertices = stats_zeros(used + vertex_num, texture_vertex_num);
+
+	fprintf(out, "{\"vertices\":%d,\"texture_vertices\":%d,\"joints\":%d,\"bones\":%d,\"triangles\":%d,",
+		vertex_num, texture_vertex_num, get_joint_num(base_model), get_bone_num(base_model), triangle_num);
+	if (vertex_num)
+		fprintf(out, "\"bbox\":{\"min\":[%.6f,%.6f,%.6f],\"max\":[%.6f,%.6f,%.6f]},",
+			min[0] * scale, min[1] * scale, min[2] * scale, max[0] * scale, max[1] * scale, max[2] * scale);
+	else
+		fprintf(out, "\"bbox\":null,");
+	fprintf(out, "\"surface_area\":%.6f,\"degenerate_triangles\":%d,\"duplicate_triangles\":%d,",
+		area * scale * scale, degenerate, duplicate);
+	fprintf(out, "\"unused_vertices\":%d,\"unused_texture_vertices\":%d,\"out_of_range_uvs\":%d,",
+		unused_vertices, unused_texture_vertices, uv_out);
+	fprintf(out, "\"vertex_range_usage\":%.6f,\"uv_range_usage\":%.6f}", abs_max / 32768.0, uv_abs_max / 32768.0);
+
+	free(coords);
+	free(keys);
+	free(used);
+}
+
+static void *stats_worker(void *arg)
+{
+	struct stats_job *job = arg;
+	struct io_file file;
+	while (io_batch_next(job->io, &file))
+	{
+		// a file without report is listed as invalid when the reports are joined
+		const char *path = file.path;
+		FILE *out = open_memstream(&job->reports[file.index], &job->report_sizes[file.index]);
+		if (!out)
+		{
+			free(file.data);
+			pthread_mutex_lock(&job->mutex);
+			printf("%s: out of memory\n", path);
+			++job->failed;
+			pthread_mutex_unlock(&job->mutex);
+			continue;
+		}
+		fprintf(out, "{\"file\":");
+		fwrite_json_string(out, path, strlen(path));
+
+		unsigned char *ddd = file.data;
+		int valid = !file.error;
+		if (valid)
+			valid = validate_batch_file(&job->mutex, path, ddd, file.size) == 0;
+		fprintf(out, ",\"valid\":%s", valid ? "true" : "false");
+		if (valid)
+		{
+			fprintf(out, ",\"scaling\":%.6f,\"bone_frames\":%d,\"base_models\":[",
+				get_scaling(ddd) / DDD_SCALE_WEIGHT, get_bone_frame_filename(ddd) ? 0 : get_bone_frame_num(ddd));
+			int base_model_num = get_base_model_num(ddd);
+			unsigned char *base_model = get_first_base_model(ddd);
+			for (int j = 0; j < base_model_num; ++j, base_model = get_next_base_model(base_model))
+			{
+				if (j)
+					fprintf(out, ",");
+				write_stats_base_model(out, ddd, base_model);
+			}
+			fprintf(out, "]");
+		}
+		fprintf(out, "}");
+		if (fclose(out))
+		{
+			free(job->reports[file.index]);
+			job->reports[file.index] = NULL;
+			valid = 0;
+		}
+		free(ddd);
+
+		if (!valid)
+		{
+			pthread_mutex_lock(&job->mutex);
+			++job->failed;
+			pthread_mutex_unlock(&job->mutex);
+		}
+	}
+	return NULL;
+}
+
+int stats_files(int count, char *paths[], const char *outpath)
+{
+	printf("Geometry statistics.\n");
+
+	struct stats_job job = { NULL, calloc(count, sizeof(char *)), calloc(count, sizeof(size_t)), 0,
+		PTHREAD_MUTEX_INITIALIZER };
+	if (!job.reports || !job.report_sizes)
+	{
+		printf("Out of memory.\n");
+		free(job.reports);
+		free(job.report_sizes);
+		return EC_NOOP;
+	}
+	FILE *out = fopen(outpath, "w");
+	if (!out)
+	{
+		printf("Cannot create %s file.\n", outpath);
+		free(job.reports);
+		free(job.report_sizes);
+		return EC_WRERR;
+	}
+	job.io = io_batch_open(count, paths);
+	if (!job.io)
+	{
+		printf("Cannot start file I/O.\n");
+		fclose(out);
+		free(job.reports);
+		free(job.report_sizes);
+		return EC_NOFILE;
+	}
+
+	int workers = thread_num > 0 ? thread_num : sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > count)
+		workers = count;
+	pthread_t *threads = malloc(workers * sizeof(*threads));
+	int started = 0;
+	for (; threads && started < workers - 1; ++started)
+		if (pthread_create(&threads[started], NULL, stats_worker, &job))
+			break;
+	stats_worker(&job);
+	for (int i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	io_batch_close(job.io);
+
+	// reports are written in input order
+	fprintf(out, "[\n");
+	for (int i = 0; i < count; ++i)
+	{
+		if (job.reports[i])
+			fwrite(job.reports[i], job.report_sizes[i], 1, out);
+		else
+		{
+			fprintf(out, "{\"file\":");
+			fwrite_json_string(out, paths[i], strlen(paths[i]));
+			fprintf(out, ",\"valid\":false}");
+		}
+		fprintf(out, i + 1 < count ? ",\n" : "\n");
+		free(job.reports[i]);
+	}
+	fprintf(out, "]\n");
+	int err = ferror(out);
+	fclose(out);
+	free(job.reports);
+	free(job.report_sizes);
+
+	if (err)
+	{
+		printf("Cannot write %s file.\n", outpath);
+		return EC_WRERR;
+	}
+	printf("%d of %d files valid, statistics written to %s.\n", count - job.failed, count, outpath);
+	return job.failed ? EC_BADFILE : EC_NONE;
+}
+
+struct verify_job
+{
+	struct io_batch *io;
+	int failed;
+	pthread_mutex_t mutex;
+};
+
+static void *verify_worker(void *arg)
+{
+	struct verify_job *job = arg;
+	struct io_file file;
+	while (io_batch_next(job->io, &file))
+	{
+		// reports are collected per file so that they do not interleave
+		char *text = NULL;
+		size_t text_size = 0;
+		FILE *report = open_memstream(&text, &text_size);
+		if (!report)
+		{
+			free(file.data);
+			pthread_mutex_lock(&job->mutex);
+			printf("%s: out of memory\n", file.path);
+			++job->failed;
+			pthread_mutex_unlock(&job->mutex);
+			continue;
+		}
+		int ret = EC_NOFILE;
+		if (file.error)
+			fprintf(report, "%s: cannot load the file\n", file.path);
+		else
+			ret = verify_ddd(report, file.path, file.data, file.size);
+		free(file.data);
+		fclose(report);
+
+		pthread_mutex_lock(&job->mutex);
+		fwrite(text, text_size, 1, stdout);
+		if (ret != EC_NONE)
+			++job->failed;
+		pthread_mutex_unlock(&job->mutex);
+		free(text);
+	}
+	return NULL;
+}
+
+int verify_files(int count, char *paths[], int thread_num)
+{
+	printf("Round trip verification.\n");
+
+	if (thread_num < 1)
+		thread_num = 1;
+	if (thread_num > count)
+		thread_num = count;
+
+	struct verify_job job = { io_batch_open(count, paths), 0, PTHREAD_MUTEX_INITIALIZER };
+	if (!job.io)
+	{
+		printf("Cannot start file I/O.\n");
+		return EC_NOFILE;
+	}
+	pthread_t *threads = malloc(thread_num * sizeof(*threads));
+	if (!threads)
+	{
+		verify_worker(&job);
+	}
+	else
+	{
+		for (int i = 0; i < thread_num; ++i)
+			pthread_create(&threads[i], NULL, verify_worker, &job);
+		for (int i = 0; i < thread_num; ++i)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+	io_batch_close(job.io);
+
+	printf("%d of %d files round trip without mismatches.\n", count - job.failed, count);
+	return job.failed ? EC_MISMATCH : EC_NONE;
+}
+
+int verify_ddd(FILE *report, const char *path, unsigned char *ddd, size_t ddd_size)
+{
+	if (validate_ddd(report, path, ddd, ddd_size) > 0)
+		return EC_BADFILE;
+
+	int ret = EC_NONE;
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	int base_model_num = get_base_model_num(ddd);
+	unsigned char *base_model = get_first_base_model(ddd);
+	for (int i = 0; i < base_model_num; ++i, base_model = get_next_base_model(base_model))
+	{
+		// DDD -> OBJ
+		char *obj = NULL;
+		size_t obj_size = 0;
+		FILE *out = open_memstream(&obj, &obj_size);
+		if (!out)
+		{
+			fprintf(report, "%s: base model %d: out of memory\n", path, i);
+			ret = EC_NOOP;
+			break;
+		}
+		write_obj_base_model(out, path, ddd, base_model);
+		fclose(out);
+
+		// OBJ -> DDD, memstreams cannot seek back to fill out placeholders so
+		// a fixed buffer with a generous bound is used instead
+		size_t rt_capacity = obj_size * 8 + 256;
+		unsigned char *rt = malloc(rt_capacity);
+		FILE *in = fmemopen(obj, obj_size, "r");
+		out = rt ? fmemopen(rt, rt_capacity, "w+") : NULL;
+		if (!in || !out)
+		{
+			fprintf(report, "%s: base model %d: out of memory\n", path, i);
+			if (in) fclose(in);
+			if (out) fclose(out);
+			free(rt);
+			free(obj);
+			ret = EC_NOOP;
+			break;
+		}
+		int converted = convert_obj(in, out);
+		fflush(out);
+		fseek(out, 0, SEEK_END);
+		size_t rt_size = ftell(out);
+		int overflow = ferror(out) || converted < 0;
+		fclose(out);
+		fclose(in);
+		free(obj);
+
+		if (overflow || validate_ddd(report, path, rt, rt_size) > 0)
+		{
+			fprintf(report, "%s: base model %d: round trip produced an invalid DDD\n", path, i);
+			free(rt);
+			ret = EC_MISMATCH;
+			continue;
+		}
+
+		// compare decoded geometry
+		unsigned char *rt_model = get_first_base_model(rt);
+		float rt_scale = get_scaling(rt) / DDD_SCALE_WEIGHT;
+		int mismatches = 0;
+
+		int vertex_num = get_vertex_num(base_model);
+		int rt_vertex_num = get_vertex_num(rt_model);
+		if (vertex_num != rt_vertex_num)
+		{
+			fprintf(report, "%s: base model %d: vertex count %d -> %d\n", path, i, vertex_num, rt_vertex_num);
+			++mismatches;
+		}
+		float max_error = 0.0f;
+		unsigned char *va = get_vertices(base_model);
+		unsigned char *vb = get_vertices(rt_model);
+		for (int j = 0; j < vertex_num && j < rt_vertex_num; ++j, va += 9, vb += 9)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				float a = (signed short)BE_SHORT(va[k * 2], va[k * 2 + 1]) * scale;
+				float b = (signed short)BE_SHORT(vb[k * 2], vb[k * 2 + 1]) * rt_scale;
+				if (fabsf(a - b) > max_error)
+					max_error = fabsf(a - b);
+			}
+		}
+
+		int texture_vertex_num = get_texture_vertex_num(base_model);
+		int rt_texture_vertex_num = get_texture_vertex_num(rt_model);
+		if (texture_vertex_num != rt_texture_vertex_num)
+		{
+			fprintf(report, "%s: base model %d: texture vertex count %d -> %d\n", path, i,
+				texture_vertex_num, rt_texture_vertex_num);
+			++mismatches;
+		}
+		float max_uv_error = 0.0f;
+		unsigned char *tva = get_texture_vertices(base_model);
+		unsigned char *tvb = get_texture_vertices(rt_model);
+		for (int j = 0; j < texture_vertex_num * 2 && j < rt_texture_vertex_num * 2; ++j)
+		{
+			float a = (signed short)BE_SHORT(tva[j * 2], tva[j * 2 + 1]) / 256.0f;
+			float b = (signed short)BE_SHORT(tvb[j * 2], tvb[j * 2 + 1]) / 256.0f;
+			if (fabsf(a - b) > max_uv_error)
+				max_uv_error = fabsf(a - b);
+		}
+
+		// empty texture groups are not written to OBJ, so the n-th used group
+		// of the original is matched against the n-th used group of the result
+		int changed_groups = 0;
+		int index_mismatches = 0;
+		unsigned char *texture = get_first_texture(base_model);
+		unsigned char *rt_texture = get_first_texture(rt_model);
+		int rt_j = 0;
+		for (int j = 0; j < MAX_DDD_TEXTURE; ++j, texture = get_next_texture(texture))
+		{
+			int triangles = get_triangle_num(texture);
+			if (!triangles)
+				continue;
+			while (rt_j < MAX_DDD_TEXTURE && !get_triangle_num(rt_texture))
+			{
+				rt_texture = get_next_texture(rt_texture);
+				++rt_j;
+			}
+			if (rt_j >= MAX_DDD_TEXTURE)
+			{
+				fprintf(report, "%s: base model %d: texture %d lost\n", path, i, j);
+				++changed_groups;
+				index_mismatches += triangles;
+				continue;
+			}
+
+			int rt_triangles = get_triangle_num(rt_texture);
+			if (rt_j != j || rt_triangles != triangles || get_texture_flags(rt_texture) != get_texture_flags(texture)
+				|| get_texture_alpha(rt_texture) != get_texture_alpha(texture))
+			{
+				char flags[256];
+				strcpy(flags, get_texture_flag_string(get_texture_flags(texture)));
+				fprintf(report, "%s: base model %d: texture %d -> %d, triangles %d -> %d, flags %s -> %s, alpha %d -> %d\n",
+					path, i, j, rt_j, triangles, rt_triangles, flags,
+					get_texture_flag_string(get_texture_flags(rt_texture)),
+					get_texture_alpha(texture), get_texture_alpha(rt_texture));
+				++changed_groups;
+			}
+
+			unsigned char *ta = get_triangles(texture);
+			unsigned char *tb = get_triangles(rt_texture);
+			for (int k = 0; k < triangles && k < rt_triangles; ++k, ta += 12, tb += 12)
+				if (memcmp(ta, tb, 12))
+					++index_mismatches;
+			if (triangles > rt_triangles)
+				index_mismatches += triangles - rt_triangles;
+
+			rt_texture = get_next_texture(rt_texture);
+			++rt_j;
+		}
+		mismatches += index_mismatches;
+
+		fprintf(report, "%s: base model %d: max position error %.6f, max UV error %.6f, %d index mismatches, %d changed texture groups\n",
+			path, i, max_error, max_uv_error, index_mismatches, changed_groups);
+		if (mismatches)
+			ret = EC_MISMATCH;
+		free(rt);
+	}
+
+	return ret;
+}
+
+struct frame_hash
+{
+	unsigned long long hash;
+	int index;
+};
+
+static int compare_frame_hash(const void *a, const void *b)
+{
+	const struct frame_hash *fa = a;
+	const struct frame_hash *fb = b;
+	if (fa->hash != fb->hash)
+		return fa->hash < fb->hash ? -1 : 1;
+	return fa->index - fb->index;
+}
+
+int dedup_ddd(const char *path, const char *outpath)
+{
+	printf("Bone frame deduplication.\n");
+
+	int err = load_ddd(path);
+	if (err != EC_NONE)
+		return err;
+
+	if (get_bone_frame_filename(ddd))
+	{
+		printf("Bone frames are stored in an external file, nothing to do.\n");
+		release_ddd();
+		return EC_NONE;
+	}
+
+	int bone_frame_num = get_bone_frame_num(ddd);
+	printf("Number of bone frames: %d\n", bone_frame_num);
+
+	// fingerprint the bones/joints/shadow payload of every frame
+	struct frame_hash *hashes = malloc((bone_frame_num + 1) * sizeof(*hashes));
+	unsigned char **frames = ddd_tables->frames;
+	unsigned char *keep = malloc(bone_frame_num + 1);
+	if (!hashes || !keep)
+	{
+		printf("Out of memory.\n");
+		free(hashes);
+		free(keep);
+		release_ddd();
+		return EC_NOOP;
+	}
+
+	for (int i = 0; i < bone_frame_num; ++i)
+	{
+		unsigned char *payload = get_bones(frames[i]);
+		hashes[i].hash = hash_bytes(payload, frames[i + 1] - payload);
+		hashes[i].index = i;
+	}
+	qsort(hashes, bone_frame_num, sizeof(*hashes), compare_frame_hash);
+
+	// report groups of identical payloads, hash collisions are ruled out by comparing bytes
+	int unique = 0;
+	for (int i = 0; i < bone_frame_num; )
+	{
+		int j = i + 1;
+		while (j < bone_frame_num && hashes[j].hash == hashes[i].hash) ++j;
+
+		for (int k = i; k < j; ++k)
+		{
+			if (hashes[k].index < 0)
+				continue;
+			unsigned char *a = get_bones(frames[hashes[k].index]);
+			size_t a_size = frames[hashes[k].index + 1] - a;
+			int dups = 0;
+			for (int l = k + 1; l < j; ++l)
+			{
+				if (hashes[l].index < 0)
+					continue;
+				unsigned char *b = get_bones(frames[hashes[l].index]);
+				size_t b_size = frames[hashes[l].index + 1] - b;
+				if (a_size != b_size || memcmp(a, b, a_size))
+					continue;
+				if (!dups)
+				{
+					printf("Duplicate %016llx: frame %d (%s)", hashes[k].hash, hashes[k].index,
+						get_action_string(get_action_name(frames[hashes[k].index])));
+				}
+				printf(", frame %d (%s)", hashes[l].index,
+					get_action_string(get_action_name(frames[hashes[l].index])));
+				hashes[l].index = -1;
+				++dups;
+			}
+			if (dups)
+				printf("\n");
+			++unique;
+		}
+		i = j;
+	}
+	printf("Unique bone frame payloads: %d\n", unique);
+
+	// the format has no frame indirection, so only a frame repeating the previous
+	// one of the same action (a held pose) can be dropped
+	int collapsed = 0;
+	size_t saved = 0;
+	int last_kept = -1;
+	for (int i = 0; i < bone_frame_num; ++i)
+	{
+		size_t size = frames[i + 1] - frames[i];
+		keep[i] = 1;
+		if (last_kept >= 0 && size == (size_t)(frames[last_kept + 1] - frames[last_kept])
+			&& !memcmp(frames[i], frames[last_kept], size))
+		{
+			keep[i] = 0;
+			++collapsed;
+			saved += size;
+		}
+		else
+		{
+			last_kept = i;
+		}
+	}
+	printf("Repeated frames that can be collapsed: %d (%zu bytes)\n", collapsed, saved);
+
+	int ret = EC_NONE;
+	if (outpath)
+	{
+		if (write_ddd_frames(outpath, ddd, keep) < 0)
+		{
+			printf("Cannot create %s file.\n", outpath);
+			ret = EC_WRERR;
+		}
+		else
+		{
+			printf("Collapsed DDD written to %s.\n", outpath);
+		}
+	}
+
+	free(keep);
+	free(hashes);
+	release_ddd();
+	return ret;
+}
+
+int parse_tolerance(const char *text, float *tolerance)
+{
+	char *end;
+	double value = strtod(text, &end);
+	if (end == text || *end || !(value >= 0.0) || value > 1e30)
+		return -1;
+	*tolerance = value;
+	return 0;
+}
+
+int parse_float(const char *text, float *value)
+{
+	char *end;
+	double number = strtod(text, &end);
+	if (end == text || *end || !isfinite(number) || fabs(number) > FLT_MAX)
+		return -1;
+	*value = number;
+	return 0;
+}
+
+// checks whether the frames between first and last can be dropped, i.e. they carry
+// no events or movement, their joints and shadow corners lie within tolerance of the
+// linear interpolation between the two, their bone normals point within
+// REDUCE_NORMAL_TOLERANCE of the interpolated direction and shadow alphas match
+static int can_interpolate(unsigned char **frames, int first, int last, int bone_num, int joint_num,
+	float scale, float tolerance)
+{
+	int joint_offset = 7 + bone_num * 6;
+	int shadow_offset = joint_offset + joint_num * 6;
+	unsigned char *ba = get_bones(frames[first]);
+	unsigned char *bb = get_bones(frames[last]);
+	unsigned char *ja = frames[first] + joint_offset;
+	unsigned char *jb = frames[last] + joint_offset;
+	for (int i = first + 1; i < last; ++i)
+	{
+		unsigned char *xymo = get_xy_movement_offset(frames[i]);
+		if (get_action_modifier_flags(frames[i]) || xymo[0] || xymo[1] || xymo[2] || xymo[3])
+			return 0;
+
+		float t = (float)(i - first) / (last - first);
+		unsigned char *ji = frames[i] + joint_offset;
+		for (int j = 0; j < joint_num * 3; ++j)
+		{
+			float a = (signed short)BE_SHORT(ja[j * 2], ja[j * 2 + 1]);
+			float b = (signed short)BE_SHORT(jb[j * 2], jb[j * 2 + 1]);
+			float c = (signed short)BE_SHORT(ji[j * 2], ji[j * 2 + 1]);
+			if (fabsf(a + (b - a) * t - c) * scale > tolerance)
+				return 0;
+		}
+
+		unsigned char *bi = get_bones(frames[i]);
+		for (int j = 0; j < bone_num; ++j)
+		{
+			float a[3], b[3], c[3], la = 0.0f, lb = 0.0f, lc = 0.0f;
+			for (int k = 0; k < 3; ++k)
+			{
+				a[k] = (signed short)BE_SHORT(ba[j * 6 + k * 2], ba[j * 6 + k * 2 + 1]);
+				b[k] = (signed short)BE_SHORT(bb[j * 6 + k * 2], bb[j * 6 + k * 2 + 1]);
+				c[k] = (signed short)BE_SHORT(bi[j * 6 + k * 2], bi[j * 6 + k * 2 + 1]);
+				la += a[k] * a[k];
+				lb += b[k] * b[k];
+				lc += c[k] * c[k];
+			}
+			la = la > 0.0f ? 1.0f / sqrtf(la) : 0.0f;
+			lb = lb > 0.0f ? 1.0f / sqrtf(lb) : 0.0f;
+			lc = lc > 0.0f ? 1.0f / sqrtf(lc) : 0.0f;
+			float d[3], ld = 0.0f, dot = 0.0f;
+			for (int k = 0; k < 3; ++k)
+			{
+				d[k] = a[k] * la + (b[k] * lb - a[k] * la) * t;
+				ld += d[k] * d[k];
+			}
+			ld = ld > 0.0f ? 1.0f / sqrtf(ld) : 0.0f;
+			for (int k = 0; k < 3; ++k)
+				dot += d[k] * ld * c[k] * lc;
+			if (dot < cosf(REDUCE_NORMAL_TOLERANCE))
+				return 0;
+		}
+
+		unsigned char *sa = frames[first] + shadow_offset;
+		unsigned char *sb = frames[last] + shadow_offset;
+		unsigned char *si = frames[i] + shadow_offset;
+		for (int j = 0; j < MAX_DDD_SHADOW_TEXTURE; ++j)
+		{
+			int alpha = get_shadow_texture_alpha(si);
+			if (alpha != get_shadow_texture_alpha(sa) || alpha != get_shadow_texture_alpha(sb))
+				return 0;
+			if (!alpha)
+			{
+				++sa, ++sb, ++si;
+				continue;
+			}
+			for (int k = 0; k < 8; ++k)
+			{
+				float a = (signed short)BE_SHORT(sa[1 + k * 2], sa[2 + k * 2]);
+				float b = (signed short)BE_SHORT(sb[1 + k * 2], sb[2 + k * 2]);
+				float c = (signed short)BE_SHORT(si[1 + k * 2], si[2 + k * 2]);
+				if (fabsf(a + (b - a) * t - c) * scale > tolerance)
+					return 0;
+			}
+			sa += 17, sb += 17, si += 17;
+		}
+	}
+	return 1;
+}
+
+int reduce_ddd(const char *path, float tolerance, const char *outpath)
+{
+	printf("Bone frame reduction.\n");
+
+	int err = load_ddd(path);
+	if (err != EC_NONE)
+		return err;
+
+	if (get_bone_frame_filename(ddd))
+	{
+		printf("Bone frames are stored in an external file, nothing to do.\n");
+		release_ddd();
+		return EC_NONE;
+	}
+
+	float scale = get_scaling(ddd) / DDD_SCALE_WEIGHT;
+	printf("Tolerance: %.6f\n", tolerance);
+	int bone_frame_num = get_bone_frame_num(ddd);
+	printf("Number of bone frames: %d\n", bone_frame_num);
+
+	unsigned char **frames = ddd_tables->frames;
+	unsigned char *keep = malloc(bone_frame_num + 1);
+	if (!keep)
+	{
+		printf("Out of memory.\n");
+		release_ddd();
+		return EC_NOOP;
+	}
+
+	// frames are reduced within runs of the same action and base model,
+	// the first and the last frame of each run are always kept
+	for (int first = 0; first < bone_frame_num; )
+	{
+		unsigned char action_id = get_action_name(frames[first]);
+		unsigned char base_model_id = get_base_model_id(frames[first]);
+		int end = first + 1;
+		while (end < bone_frame_num && get_action_name(frames[end]) == action_id
+			&& get_base_model_id(frames[end]) == base_model_id)
+			++end;
+
+		unsigned char *base_model = get_base_model_from_id(ddd, base_model_id);
+		int bone_num = get_bone_num(base_model);
+		int joint_num = get_joint_num(base_model);
+
+		int k = first;
+		keep[k] = 1;
+		while (k < end - 1)
+		{
+			int j = k + 1;
+			while (j + 1 < end && can_interpolate(frames, k, j + 1, bone_num, joint_num, scale, tolerance))
+				++j;
+			for (int i = k + 1; i < j; ++i)
+				keep[i] = 0;
+			keep[j] = 1;
+			k = j;
+		}
+		first = end;
+	}
+
+	// per action report
+	size_t total_saved = 0;
+	for (int a = 0; a < 256; ++a)
+	{
+		int before = 0, after = 0;
+		size_t saved = 0;
+		for (int i = 0; i < bone_frame_num; ++i)
+		{
+			if (get_action_name(frames[i]) != a)
+				continue;
+			++before;
+			if (keep[i])
+				++after;
+			else
+				saved += frames[i + 1] - frames[i];
+		}
+		if (before)
+			printf("Action %s (%02x): %d -> %d frames, %zu bytes saved\n", get_action_string(a), a, before, after, saved);
+		total_saved += saved;
+	}
+	printf("Total: %zu bytes saved\n", total_saved);
+
+	int ret = EC_NONE;
+	if (outpath)
+	{
+		if (write_ddd_frames(outpath, ddd, keep) < 0)
+		{
+			printf("Cannot create %s file.\n", outpath);
+			ret = EC_WRERR;
+		}
+		else
+		{
+			printf("Reduced DDD written to %s.\n", outpath);
+		}
+	}
+
+	free(keep);
+	release_ddd();
+	return ret;
+}
+
+// rounds (v * mul + add) / 2^32 for every value, returns the number of
+// results that do not fit into a signed short
+static int requantize(int *values, int count, long long mul, long long add)
+{
+	int overflow = 0;
+	add += 1ll << 31;
+	for (int i = 0; i < count; ++i)
+	{
+		long long v = (values[i] * mul + add) >> 32;
+		overflow += v < -32768 || v > 32767;
+		values[i] = v;
+	}
+	return overflow;
+}
+
+// requantizes the first `axes` big-endian shorts of `count` entries `stride` bytes apart,
+// each axis is gathered into `scratch` so that the kernel runs over a plain array
+static int requantize_table(unsigned char *table, int count, int stride, int axes,
+	const long long *mul, const long long *add, int *scratch)
+{
+	int overflow = 0;
+	for (int k = 0; k < axes; ++k)
+	{
+		unsigned char *p = table + k * 2;
+		for (int i = 0; i < count; ++i, p += stride)
+			scratch[i] = (signed short)BE_SHORT(p[0], p[1]);
+		overflow += requantize(scratch, count, mul[k], add[k]);
+		p = table + k * 2;
+		for (int i = 0; i < count; ++i, p += stride)
+		{
+			p[0] = scratch[i] >> 8;
+			p[1] = scratch[i] & 0xff;
+		}
+	}
+	return overflow;
+}
+
+static void update_extent(unsigned char *table, int count, int stride, int axes, int *min, int *max)
+{
+	for (int i = 0; i < count; ++i, table += stride)
+		for (int k = 0; k < axes; ++k)
+		{
+			int v = (signed short)BE_SHORT(table[k * 2], table[k * 2 + 1]);
+			min[k] = v < min[k] ? v : min[k];
+			max[k] = v > max[k] ? v : max[k];
+		}
+}
+
+int transform_ddd(const char *path, const char *outpath, const struct transform *t)
+{
+	printf("DDD transform.\n");
+
+	int err = load_ddd(path);
+	if (err != EC_NONE)
+		return err;
+
+	int geometry = t->scale != 1.0f || t->translate[0] || t->translate[1] || t->translate[2] || t->center || t->scaling;
+	int frames = !get_bone_frame_filename(ddd);
+	if (geometry && !frames)
+	{
+		printf("Bone frames are stored in an external file, geometry cannot be transformed.\n");
+		release_ddd();
+		return EC_NOOP;
+	}
+
+	// the tables keep their sizes, so the copy is changed in place
+	size_t size = ddd_size;
+	unsigned char *out = malloc(size);
+	int *scratch = malloc(65536 * sizeof(*scratch));
+	if (!out || !scratch)
+	{
+		printf("Out of memory.\n");
+		free(out);
+		free(scratch);
+		release_ddd();
+		return EC_NOOP;
+	}
+	memcpy(out, ddd, size);
+	release_ddd();
+
+	int base_model_num = get_base_model_num(out);
+	int bone_frame_num = frames ? get_bone_frame_num(out) : 0;
+
+	// extents of vertices, and of everything quantized with Scaling
+	int vertex_min[3] = { 32767, 32767, 32767 }, vertex_max[3] = { -32768, -32768, -32768 };
+	int min[3], max[3];
+	unsigned char *base_model = get_first_base_model(out);
+	for (int i = 0; i < base_model_num; ++i, base_model = get_next_base_model(base_model))
+		update_extent(get_vertices(base_model), get_vertex_num(base_model), 9, 3, vertex_min, vertex_max);
+	memcpy(min, vertex_min, sizeof(min));
+	memcpy(max, vertex_max, sizeof(max));
+	unsigned char *bone_frame = get_first_bone_frame(out);
+	for (int i = 0; i < bone_frame_num; ++i, bone_frame = get_next_bone_frame(out, bone_frame))
+	{
+		unsigned char *model = get_base_model_from_id(out, get_base_model_id(bone_frame));
+		update_extent(get_joints(out, bone_frame), get_joint_num(model), 6, 3, min, max);
+		unsigned char *shadow = get_shadow_texture_data(out, bone_frame);
+		for (int j = 0; j < MAX_DDD_SHADOW_TEXTURE; ++j)
+		{
+			if (!get_shadow_texture_alpha(shadow))
+			{
+				++shadow;
+				continue;
+			}
+			update_extent(shadow + 1, 4, 4, 2, min, max);
+			shadow += 17;
+		}
+	}
+
+	// world = raw * Scaling / DDD_SCALE_WEIGHT, then scaled and moved
+	int old_scaling = get_scaling(out);
+	double world = old_scaling / DDD_SCALE_WEIGHT;
+	double offset[3] = { t->translate[0], t->translate[1], t->translate[2] };
+	if (t->center && vertex_min[0] <= vertex_max[0])
+	{
+		offset[0] -= (vertex_min[0] + vertex_max[0]) * 0.5 * world * t->scale;
+		offset[1] -= (vertex_min[1] + vertex_max[1]) * 0.5 * world * t->scale;
+		offset[2] -= vertex_min[2] * world * t->scale;
+	}
+	int scaling = t->scaling ? t->scaling : old_scaling;
+	if (t->scaling < 0)
+	{
+		double extent = 0.0;
+		for (int k = 0; k < 3 && min[k] <= max[k]; ++k)
+		{
+			double a = fabs(min[k] * world * t->scale + offset[k]);
+			double b = fabs(max[k] * world * t->scale + offset[k]);
+			extent = a > extent ? a : extent;
+			extent = b > extent ? b : extent;
+		}
+		scaling = ceil(extent * DDD_SCALE_WEIGHT / 32767.0);
+		scaling = scaling < 1 ? 1 : scaling;
+	}
+
+	double ratio = world * t->scale * DDD_SCALE_WEIGHT / scaling;
+	long long mul[3], add[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		mul[k] = llround(ratio * 4294967296.0);
+		add[k] = llround(offset[k] * DDD_SCALE_WEIGHT / scaling * 4294967296.0);
+	}
+	if (scaling > 65535 || ratio >= 32768.0 || fabs(offset[0]) + fabs(offset[1]) + fabs(offset[2]) >= scaling / DDD_SCALE_WEIGHT * 1048576.0)
+	{
+		printf("The transformed model does not fit into 16-bit coordinates.\n");
+		free(scratch);
+		free(out);
+		return EC_NOOP;
+	}
+	printf("Scaling: %d -> %d\n", old_scaling, scaling);
+	printf("Scale factor: %.6f, offset: %.6f, %.6f, %.6f\n", t->scale, offset[0], offset[1], offset[2]);
+
+	// U and V of 1.0 are 256, V is stored negated
+	long long uv_mul[2] = { t->flip_u ? -(1ll << 32) : 1ll << 32, t->flip_v ? -(1ll << 32) : 1ll << 32 };
+	long long uv_add[2] = { t->flip_u ? 256ll << 32 : 0, t->flip_v ? -(256ll << 32) : 0 };
+	// XY movement is in world units (1/256), joint sizes too (JOINT_COLLISION_SCALE)
+	long long move_mul[2] = { llround(t->scale * 4294967296.0), llround(t->scale * 4294967296.0) };
+	long long move_add[2] = { 0, 0 };
+
+	int overflow = 0, joint_size_overflow = 0;
+	int vertices = 0, texture_vertices = 0, joints = 0, shadows = 0, textures = 0;
+	base_model = get_first_base_model(out);
+	for (int i = 0; i < base_model_num; ++i, base_model = get_next_base_model(base_model))
+	{
+		int vertex_num = get_vertex_num(base_model);
+		int texture_vertex_num = get_texture_vertex_num(base_model);
+		int joint_num = get_joint_num(base_model);
+		if (geometry)
+		{
+			overflow += requantize_table(get_vertices(base_model), vertex_num, 9, 3, mul, add, scratch);
+			vertices += vertex_num;
+		}
+		if (t->flip_u || t->flip_v)
+		{
+			overflow += requantize_table(get_texture_vertices(base_model), texture_vertex_num, 4, 2, uv_mul, uv_add, scratch);
+			texture_vertices += texture_vertex_num;
+		}
+
+		unsigned char *texture = get_first_texture(base_model);
+		for (int j = 0; j < MAX_DDD_TEXTURE; ++j, texture = get_next_texture(texture))
+		{
+			if (!get_rendering_mode(texture) || (t->flags[j] < 0 && t->alpha[j] < 0))
+				continue;
+			if (t->flags[j] >= 0)
+				texture[1] = t->flags[j];
+			if (t->alpha[j] >= 0)
+				texture[2] = t->alpha[j];
+			++textures;
+		}
+
+		unsigned char *joint_data = get_joint_data(base_model);
+		for (int j = 0; j < joint_num && t->scale != 1.0f; ++j)
+		{
+			long size = lround(joint_data[j] * t->scale);
+			joint_size_overflow += size > 255;
+			joint_data[j] = size;
+		}
+	}
+
+	bone_frame = get_first_bone_frame(out);
+	for (int i = 0; i < bone_frame_num && geometry; ++i, bone_frame = get_next_bone_frame(out, bone_frame))
+	{
+		// bone forward normals are directions and do not change
+		unsigned char *model = get_base_model_from_id(out, get_base_model_id(bone_frame));
+		if (t->scale != 1.0f)
+			overflow += requantize_table(get_xy_movement_offset(bone_frame), 1, 4, 2, move_mul, move_add, scratch);
+		overflow += requantize_table(get_joints(out, bone_frame), get_joint_num(model), 6, 3, mul, add, scratch);
+		joints += get_joint_num(model);
+
+		unsigned char *shadow = get_shadow_texture_data(out, bone_frame);
+		for (int j = 0; j < MAX_DDD_SHADOW_TEXTURE; ++j)
+		{
+			if (!get_shadow_texture_alpha(shadow))
+			{
+				++shadow;
+				continue;
+			}
+			overflow += requantize_table(shadow + 1, 4, 4, 2, mul, add, scratch);
+			shadows += 4;
+			shadow += 17;
+		}
+	}
+	free(scratch);
+
+	if (overflow)
+	{
+		printf("%d values do not fit into 16 bits, try --scaling auto.\n", overflow);
+		free(out);
+		return EC_NOOP;
+	}
+	// joint sizes are single bytes in model units, a scaling does not help them
+	if (joint_size_overflow)
+	{
+		printf("%d joint sizes do not fit into 8 bits, use a smaller --scale.\n", joint_size_overflow);
+		free(out);
+		return EC_NOOP;
+	}
+	out[0] = scaling >> 8;
+	out[1] = scaling & 0xff;
+
+	printf("Vertices: %d, texture vertices: %d, textures: %d\n", vertices, texture_vertices, textures);
+	printf("Joint positions: %d, shadow corners: %d in %d bone frames\n", joints, shadows, bone_frame_num);
+
+	FILE *file = fopen(outpath, "wb");
+	int write_err = !file || fwrite(out, size, 1, file) != 1;
+	if (file && fclose(file))
+		write_err = 1;
+	free(out);
+	if (write_err)
+	{
+		printf("Cannot write %s file.\n", outpath);
+		return EC_WRERR;
+	}
+	printf("Transformed DDD written to %s.\n", outpath);
+	return EC_NONE;
+}
+
+int validate_files(int count, char *paths[])
+{
+	printf("DDD validation.\n");
+
+	struct io_batch *io = io_batch_open(count, paths);
+	if (!io)
+	{
+		printf("Cannot start file I/O.\n");
+		return EC_NOFILE;
+	}
+
+	int failed = 0;
+	struct io_file file;
+	while (io_batch_next(io, &file))
+	{
+		if (file.error)
+		{
+			printf("%s: error: cannot load the file\n", file.path);
+			++failed;
+			continue;
+		}
+		if (validate_ddd(stdout, file.path, file.data, file.size) > 0)
+			++failed;
+		free(file.data);
+	}
+	io_batch_close(io);
+
+	printf("%d of %d files valid.\n", count - failed, count);
+	return failed ? EC_BADFILE : EC_NONE;
+}
+
+// reports an error at the given offset, only the first few are printed
+#define VALIDATION_ERROR(offset, ...) \
+	do { \
+		if (errors++ < MAX_VALIDATION_ERRORS) \
+		{ \
+			fprintf(log, "%s:0x%06zx: error: ", path, (size_t)(offset)); \
+			fprintf(log, __VA_ARGS__); \
+			fprintf(log, "\n"); \
+		} \
+	} while (0)
+
+// reports a problem that does not keep the file from being used
+#define VALIDATION_WARNING(offset, ...) \
+	do { \
+		if (warnings++ < MAX_VALIDATION_ERRORS) \
+		{ \
+			fprintf(log, "%s:0x%06zx: warning: ", path, (size_t)(offset)); \
+			fprintf(log, __VA_ARGS__); \
+			fprintf(log, "\n"); \
+		} \
+	} while (0)
+
+// bails out when the next n bytes are not within the buffer
+#define VALIDATION_NEED(n, what) \
+	do { \
+		if ((size_t)(n) > size - pos) \
+		{ \
+			VALIDATION_ERROR(pos, "truncated %s, %zu bytes needed, %zu left", what, (size_t)(n), size - pos); \
+			goto done; \
+		} \
+	} while (0)
+
+int validate_ddd(FILE *log, const char *path, const unsigned char *ddd, size_t size)
+{
+	// single pass over the buffer, never reads outside of it
+	int errors = 0, warnings = 0;
+	size_t pos = 0;
+
+	VALIDATION_NEED(8 + MAX_DDD_SHADOW_TEXTURE, "header");
+	unsigned short flags = BE_SHORT(ddd[2], ddd[3]);
+	int base_model_num = ddd[5];
+	int bone_frame_num = BE_SHORT(ddd[6], ddd[7]);
+	pos += 8 + MAX_DDD_SHADOW_TEXTURE;
+	if (flags & DDD_EXTERNAL_BONE_FRAMES)
+	{
+		VALIDATION_NEED(8, "bone frame filename");
+		pos += 8;
+	}
+
+	// joint and bone counts of base models are needed to walk bone frames
+	unsigned short joint_nums[256];
+	unsigned short bone_nums[256];
+
+	for (int i = 0; i < base_model_num; ++i)
+	{
+		VALIDATION_NEED(8, "base model header");
+		int vertex_num = BE_SHORT(ddd[pos], ddd[pos + 1]);
+		int texture_vertex_num = BE_SHORT(ddd[pos + 2], ddd[pos + 3]);
+		int joint_num = BE_SHORT(ddd[pos + 4], ddd[pos + 5]);
+		int bone_num = BE_SHORT(ddd[pos + 6], ddd[pos + 7]);
+		joint_nums[i] = joint_num;
+		bone_nums[i] = bone_num;
+		pos += 8;
+
+		VALIDATION_NEED((size_t)vertex_num * 9, "vertex table");
+		for (int j = 0; j < vertex_num; ++j, pos += 9)
+		{
+			if (bone_num > 0 && (ddd[pos + 6] >= bone_num || ddd[pos + 7] >= bone_num))
+				VALIDATION_ERROR(pos + 6, "base model %d vertex %d bone binding %d %d out of range (%d bones)",
+					i, j, ddd[pos + 6], ddd[pos + 7], bone_num);
+		}
+
+		VALIDATION_NEED((size_t)texture_vertex_num * 4, "texture vertex table");
+		pos += (size_t)texture_vertex_num * 4;
+
+		for (int j = 0; j < MAX_DDD_TEXTURE; ++j)
+		{
+			VALIDATION_NEED(1, "texture");
+			if (!ddd[pos])
+			{
+				++pos;
+				continue;
+			}
+			VALIDATION_NEED(5, "texture header");
+			int triangle_num = BE_SHORT(ddd[pos + 3], ddd[pos + 4]);
+			pos += 5;
+			VALIDATION_NEED((size_t)triangle_num * 12, "triangle table");
+			for (int k = 0; k < triangle_num; ++k)
+			{
+				for (int l = 0; l < 3; ++l, pos += 4)
+				{
+					int v = BE_SHORT(ddd[pos], ddd[pos + 1]);
+					int tv = BE_SHORT(ddd[pos + 2], ddd[pos + 3]);
+					if (v >= vertex_num)
+						VALIDATION_ERROR(pos, "base model %d texture %d triangle %d vertex index %d out of range (%d vertices)",
+							i, j, k, v, vertex_num);
+					if (tv >= texture_vertex_num)
+						VALIDATION_ERROR(pos + 2, "base model %d texture %d triangle %d texture vertex index %d out of range (%d texture vertices)",
+							i, j, k, tv, texture_vertex_num);
+				}
+			}
+		}
+
+		VALIDATION_NEED(joint_num, "joint table");
+		pos += joint_num;
+
+		VALIDATION_NEED((size_t)bone_num * 5, "bone table");
+		for (int j = 0; j < bone_num; ++j, pos += 5)
+		{
+			int ja = BE_SHORT(ddd[pos + 1], ddd[pos + 2]);
+			int jb = BE_SHORT(ddd[pos + 3], ddd[pos + 4]);
+			if (ja >= joint_num || jb >= joint_num)
+				VALIDATION_ERROR(pos + 1, "base model %d bone %d joints %d %d out of range (%d joints)",
+					i, j, ja, jb, joint_num);
+		}
+	}
+
+	if (!(flags & DDD_EXTERNAL_BONE_FRAMES))
+	{
+		for (int i = 0; i < bone_frame_num; ++i)
+		{
+			VALIDATION_NEED(7, "bone frame header");
+			int action_id = ddd[pos];
+			int base_model_id = ddd[pos + 2];
+			// unknown actions are shown as such, they do not break the layout
+			if (action_id >= (int)(sizeof(action_strings) / sizeof(*action_strings)))
+				VALIDATION_WARNING(pos, "bone frame %d has unknown action %d", i, action_id);
+			if (base_model_id >= base_model_num)
+			{
+				VALIDATION_ERROR(pos + 2, "bone frame %d base model %d out of range (%d base models)",
+					i, base_model_id, base_model_num);
+				goto done;
+			}
+			pos += 7;
+
+			VALIDATION_NEED((size_t)bone_nums[base_model_id] * 6 + (size_t)joint_nums[base_model_id] * 6, "bone frame");
+			pos += (size_t)bone_nums[base_model_id] * 6 + (size_t)joint_nums[base_model_id] * 6;
+
+			for (int j = 0; j < MAX_DDD_SHADOW_TEXTURE; ++j)
+			{
+				VALIDATION_NEED(1, "shadow texture data");
+				if (ddd[pos])
+				{
+					VALIDATION_NEED(17, "shadow texture vertices");
+					pos += 17;
+				}
+				else
+				{
+					++pos;
+				}
+			}
+		}
+	}
+
+	if (pos != size)
+		VALIDATION_ERROR(pos, "%zu trailing bytes", size - pos);
+
+done:
+	if (errors > MAX_VALIDATION_ERRORS)
+		fprintf(log, "%s: %d more errors\n", path, errors - MAX_VALIDATION_ERRORS);
+	if (warnings > MAX_VALIDATION_ERRORS)
+		fprintf(log, "%s: %d more warnings\n", path, warnings - MAX_VALIDATION_ERRORS);
+	return errors;
+}
+
+#undef VALIDATION_NEED
+#undef VALIDATION_WARNING
+#undef VALIDATION_ERROR
+
+int write_ddd_frames(const char *path, unsigned char *ddd, const unsigned char *keep)
+{
+	FILE *out = fopen(path, "wb");
+	if (!out)
+		return -1;
+
+	int bone_frame_num = get_bone_frame_num(ddd);
+	int kept = 0;
+	for (int i = 0; i < bone_frame_num; ++i)
+		if (keep[i]) ++kept;
+
+	// header and base models are copied verbatim, only the frame count changes
+	unsigned char *bone_frame = get_first_bone_frame(ddd);
+	fwrite(ddd, 6, 1, out);
+	fwrite_short(out, kept);
+	fwrite(ddd + 8, bone_frame - (ddd + 8), 1, out);
+
+	for (int i = 0; i < bone_frame_num; ++i)
+	{
+		unsigned char *next = get_next_bone_frame(ddd, bone_frame);
+		if (keep[i])
+			fwrite(bone_frame, next - bone_frame, 1, out);
+		bone_frame = next;
+	}
+
+	int err = ferror(out);
+	fclose(out);
+	return err ? -1 : 0;
+}
+
+unsigned char **get_bone_frame_table(unsigned char *ddd)
+{
+	// pointers to every bone frame plus one past the last
+	int bone_frame_num = get_bone_frame_num(ddd);
+	unsigned char **frames = malloc((bone_frame_num + 1) * sizeof(*frames));
+	if (!frames)
+		return NULL;
+
+	unsigned char *bone_frame = get_first_bone_frame(ddd);
+	for (int i = 0; i < bone_frame_num; ++i)
+	{
+		frames[i] = bone_frame;
+		bone_frame = get_next_bone_frame(ddd, bone_frame);
+	}
+	frames[bone_frame_num] = bone_frame;
+	return frames;
+}
+
+const char *get_action_string(unsigned char action_id)
+{
+	if (action_id < sizeof(action_strings) / sizeof(*action_strings))
+		return action_strings[action_id];
+	return "unknown";
+}
+
+unsigned long long hash_bytes(const unsigned char *data, size_t size)
+{
+	// 64-bit FNV-1a
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Compressed outputs are FILE cookies that collect text into large blocks.
+// The blocks are compressed and written by a pool of compressor threads, one
+// per output opened at the same time up to the number of worker threads. All
+// blocks of a file go to the same compressor thread, so they reach the disk in
+// order while files written by different workers are compressed in parallel.
+struct compress_queue;
+
+struct compress_stream
+{
+	FILE *file;
+	struct compress_queue *queue;
+	unsigned char *block;
+	size_t used;
+	int error;	// set by the compressor thread
+	int done;	// the last block was written and the file closed
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zc;
+#endif
+};
+
+struct compress_task
+{
+	struct compress_stream *stream;
+	unsigned char *block;
+	size_t size;
+	int last;
+};
+
+struct compress_queue
+{
+	struct compress_task tasks[COMPRESS_QUEUE_SIZE];
+	int head;
+	int count;
+	unsigned char *out;	// compressed data before it is written
+	pthread_t thread;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+static struct
+{
+	struct compress_queue queues[COMPRESS_MAX_THREADS];
+	int thread_num;	// started compressor threads
+	int next;	// queue given to the next stream once all threads run
+	int running;
+	int error;
+	pthread_mutex_t mutex;
+	pthread_cond_t closed;	// a stream is done
+} compressor = { .mutex = PTHREAD_MUTEX_INITIALIZER, .closed = PTHREAD_COND_INITIALIZER };
+
+static int compress_block(struct compress_stream *stream, unsigned char *out, unsigned char *block, size_t size, int last)
+{
+	int err = 0;
+
+#ifdef HAVE_ZLIB
+	if (output_compression == COMPRESSION_GZ)
+	{
+		stream->z.next_in = block;
+		stream->z.avail_in = size;
+		int ret;
+		do
+		{
+			stream->z.next_out = out;
+			stream->z.avail_out = COMPRESS_BLOCK_SIZE;
+			ret = deflate(&stream->z, last ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_ERROR)
+				return -1;
+			size_t n = COMPRESS_BLOCK_SIZE - stream->z.avail_out;
+			if (n && fwrite(out, n, 1, stream->file) != 1)
+				err = -1;
+		} while (stream->z.avail_out == 0 || (last && ret != Z_STREAM_END));
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (output_compression == COMPRESSION_ZSTD)
+	{
+		ZSTD_inBuffer in = { block, size, 0 };
+		size_t remaining;
+		do
+		{
+			ZSTD_outBuffer zout = { out, COMPRESS_BLOCK_SIZE, 0 };
+			remaining = ZSTD_compressStream2(stream->zc, &zout, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining))
+				return -1;
+			if (zout.pos && fwrite(out, zout.pos, 1, stream->file) != 1)
+				err = -1;
+		} while (last ? remaining != 0 : in.pos < in.size);
+	}
+#endif
+	(void)stream; (void)out; (void)block; (void)size; (void)last;
+	return err;
+}
+
+static void *compressor_thread(void *arg)
+{
+	struct compress_queue *queue = arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&compressor.mutex);
+		while (!queue->count && compressor.running)
+			pthread_cond_wait(&queue->not_empty, &compressor.mutex);
+		if (!queue->count)
+		{
+			pthread_mutex_unlock(&compressor.mutex);
+			break;
+		}
+		struct compress_task task = queue->tasks[queue->head];
+		queue->head = (queue->head + 1) % COMPRESS_QUEUE_SIZE;
+		--queue->count;
+		pthread_cond_signal(&queue->not_full);
+		pthread_mutex_unlock(&compressor.mutex);
+
+		struct compress_stream *stream = task.stream;
+		int err = compress_block(stream, queue->out, task.block, task.size, task.last);
+		free(task.block);
+		if (task.last)
+		{
+#ifdef HAVE_ZLIB
+			if (output_compression == COMPRESSION_GZ)
+				deflateEnd(&stream->z);
+#endif
+#ifdef HAVE_ZSTD
+			if (output_compression == COMPRESSION_ZSTD)
+				ZSTD_freeCCtx(stream->zc);
+#endif
+			if (fclose(stream->file))
+				err = -1;
+		}
+
+		// the stream is freed by compress_close() once it is done
+		pthread_mutex_lock(&compressor.mutex);
+		if (err)
+			stream->error = compressor.error = 1;
+		if (task.last)
+		{
+			stream->done = 1;
+			pthread_cond_broadcast(&compressor.closed);
+		}
+		pthread_mutex_unlock(&compressor.mutex);
+	}
+	return NULL;
+}
+
+static struct compress_queue *compress_assign(void)
+{
+	// a thread is started for each new stream until there is one per worker,
+	// later streams are spread over the running threads
+	int wanted = thread_num > 0 ? thread_num : sysconf(_SC_NPROCESSORS_ONLN);
+	if (wanted > COMPRESS_MAX_THREADS)
+		wanted = COMPRESS_MAX_THREADS;
+
+	pthread_mutex_lock(&compressor.mutex);
+	if (!compressor.thread_num)
+	{
+		compressor.error = 0;
+		compressor.running = 1;
+	}
+	if (compressor.thread_num < wanted)
+	{
+		struct compress_queue *queue = &compressor.queues[compressor.thread_num];
+		queue->head = queue->count = 0;
+		queue->out = malloc(COMPRESS_BLOCK_SIZE);
+		pthread_cond_init(&queue->not_empty, NULL);
+		pthread_cond_init(&queue->not_full, NULL);
+		if (queue->out && !pthread_create(&queue->thread, NULL, compressor_thread, queue))
+			++compressor.thread_num;
+		else
+		{
+			free(queue->out);
+			pthread_cond_destroy(&queue->not_empty);
+			pthread_cond_destroy(&queue->not_full);
+		}
+	}
+	struct compress_queue *queue = NULL;
+	if (compressor.thread_num)
+		queue = &compressor.queues[compressor.next++ % compressor.thread_num];
+	pthread_mutex_unlock(&compressor.mutex);
+	return queue;
+}
+
+static void compress_enqueue(struct compress_stream *stream, int last)
+{
+	struct compress_queue *queue = stream->queue;
+	pthread_mutex_lock(&compressor.mutex);
+	while (queue->count == COMPRESS_QUEUE_SIZE)
+		pthread_cond_wait(&queue->not_full, &compressor.mutex);
+	struct compress_task *task = &queue->tasks[(queue->head + queue->count) % COMPRESS_QUEUE_SIZE];
+	task->stream = stream;
+	task->block = stream->block;
+	task->size = stream->used;
+	task->last = last;
+	++queue->count;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&compressor.mutex);
+
+	stream->block = NULL;
+	stream->used = 0;
+}
+
+static ssize_t compress_write(void *cookie, const char *buf, size_t size)
+{
+	struct compress_stream *stream = cookie;
+	size_t written = 0;
+	while (written < size)
+	{
+		if (!stream->block)
+		{
+			stream->block = malloc(COMPRESS_BLOCK_SIZE);
+			if (!stream->block)
+				return written;
+		}
+		size_t n = COMPRESS_BLOCK_SIZE - stream->used;
+		if (n > size - written)
+			n = size - written;
+		memcpy(stream->block + stream->used, buf + written, n);
+		stream->used += n;
+		written += n;
+		if (stream->used == COMPRESS_BLOCK_SIZE)
+			compress_enqueue(stream, 0);
+	}
+	return written;
+}
+
+static int compress_close(void *cookie)
+{
+	// the compressor thread finishes the stream and closes the file, the result
+	// is waited for so that fclose() reports errors of this file
+	struct compress_stream *stream = cookie;
+	compress_enqueue(stream, 1);
+	pthread_mutex_lock(&compressor.mutex);
+	while (!stream->done)
+		pthread_cond_wait(&compressor.closed, &compressor.mutex);
+	int err = stream->error;
+	pthread_mutex_unlock(&compressor.mutex);
+	free(stream);
+	return err ? EOF : 0;
+}
+
+static void compress_free(struct compress_stream *stream)
+{
+#ifdef HAVE_ZLIB
+	if (output_compression == COMPRESSION_GZ)
+		deflateEnd(&stream->z);
+#endif
+#ifdef HAVE_ZSTD
+	if (output_compression == COMPRESSION_ZSTD)
+		ZSTD_freeCCtx(stream->zc);
+#endif
+	fclose(stream->file);
+	free(stream);
+}
+
+FILE *open_output(const char *filename, const char *mode)
+{
+	if (output_compression == COMPRESSION_NONE)
+		return fopen(filename, mode);
+
+	struct compress_stream *stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return NULL;
+	// appended data becomes a new gzip member or zstd frame
+	stream->file = fopen(filename, mode[0] == 'a' ? "ab" : "wb");
+	if (!stream->file)
+	{
+		free(stream);
+		return NULL;
+	}
+
+	int ok = 0;
+#ifdef HAVE_ZLIB
+	if (output_compression == COMPRESSION_GZ)
+		ok = deflateInit2(&stream->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+#endif
+#ifdef HAVE_ZSTD
+	if (output_compression == COMPRESSION_ZSTD)
+		ok = (stream->zc = ZSTD_createCCtx()) != NULL;
+#endif
+	if (!ok)
+	{
+		fclose(stream->file);
+		free(stream);
+		return NULL;
+	}
+
+	// threads started for a stream that fails below are joined by finish_output()
+	stream->queue = compress_assign();
+
+	cookie_io_functions_t io = { NULL, compress_write, NULL, compress_close };
+	FILE *file = stream->queue ? fopencookie(stream, "w", io) : NULL;
+	if (!file)
+	{
+		compress_free(stream);
+		return NULL;
+	}
+	setvbuf(file, NULL, _IOFBF, 1 << 16);
+	return file;
+}
+
+int finish_output(void)
+{
+	// waits until all closed outputs are compressed and written
+	pthread_mutex_lock(&compressor.mutex);
+	int started = compressor.thread_num;
+	compressor.running = 0;
+	for (int i = 0; i < started; ++i)
+		pthread_cond_signal(&compressor.queues[i].not_empty);
+	pthread_mutex_unlock(&compressor.mutex);
+	if (!started)
+		return 0;
+
+	for (int i = 0; i < started; ++i)
+	{
+		struct compress_queue *queue = &compressor.queues[i];
+		pthread_join(queue->thread, NULL);
+		free(queue->out);
+		pthread_cond_destroy(&queue->not_empty);
+		pthread_cond_destroy(&queue->not_full);
+	}
+	compressor.thread_num = 0;
+	compressor.next = 0;
+	return compressor.error ? -1 : 0;
+}
+
+// In serve mode DDD files stay mapped between jobs. Entries are keyed by
+// device and inode and dropped when the file changes or is least recently used.
+struct cache_entry
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	size_t size;
+	int fd;	// kept open to check the mapped file itself before reuse
+	unsigned char *data;
+	struct ddd_tables *tables;
+	unsigned long long last_used;
+};
+
+static struct
+{
+	int enabled;
+	int hit;	// whether the last load_ddd() was served from the cache
+	unsigned long long clock;
+	size_t bytes;
+	struct cache_entry entries[CACHE_ENTRIES];
+} ddd_cache;
+
+static void cache_evict(struct cache_entry *entry)
+{
+	munmap(entry->data, entry->size);
+	close(entry->fd);
+	free(entry->tables->frames);
+	free(entry->tables);
+	ddd_cache.bytes -= entry->size;
+	entry->data = NULL;
+}
+
+// decodes where base models and bone frames start, the file has to be valid
+static struct ddd_tables *decode_ddd(unsigned char *data)
+{
+	struct ddd_tables *tables = calloc(1, sizeof(*tables));
+	if (!tables)
+		return NULL;
+	tables->data = data;
+	unsigned char *base_model = get_first_base_model(data);
+	for (int i = 0; i < get_base_model_num(data); ++i, base_model = get_next_base_model(base_model))
+		tables->base_models[i] = base_model;
+	if (!get_bone_frame_filename(data) && !(tables->frames = get_bone_frame_table(data)))
+	{
+		free(tables);
+		return NULL;
+	}
+	return tables;
+}
+
+int load_ddd(const char *path)
+{
+	ddd_cache.hit = 0;
+	if (!ddd_cache.enabled)
+	{
+		if (load_file(path, &ddd, &ddd_size) < 0)
+		{
+			printf("Cannot load the file.\n");
+			return EC_NOFILE;
+		}
+		if (validate_ddd(stdout, path, ddd, ddd_size) > 0)
+		{
+			free(ddd);
+			ddd = NULL;
+			return EC_BADFILE;
+		}
+		ddd_tables = decode_ddd(ddd);
+		if (!ddd_tables)
+		{
+			printf("Out of memory.\n");
+			free(ddd);
+			ddd = NULL;
+			return EC_NOOP;
+		}
+		return EC_NONE;
+	}
+
+	struct stat st;
+	if (stat(path, &st) < 0 || st.st_size == 0)
+	{
+		printf("Cannot load the file.\n");
+		return EC_NOFILE;
+	}
+
+	struct cache_entry *entry = NULL;
+	for (int i = 0; i < CACHE_ENTRIES; ++i)
+	{
+		struct cache_entry *e = &ddd_cache.entries[i];
+		if (e->data && e->dev == st.st_dev && e->ino == st.st_ino)
+		{
+			// a mapping of a file that shrank would fault, so the open file is checked too
+			struct stat fst;
+			if (fstat(e->fd, &fst) == 0 && e->size == (size_t)st.st_size && e->size == (size_t)fst.st_size
+				&& e->mtime.tv_sec == fst.st_mtim.tv_sec && e->mtime.tv_nsec == fst.st_mtim.tv_nsec)
+				entry = e;
+			else
+				cache_evict(e);
+			break;
+		}
+	}
+
+	if (entry)
+	{
+		ddd_cache.hit = 1;
+	}
+	else
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		struct stat fst;
+		void *data = fd >= 0 && fstat(fd, &fst) == 0 && fst.st_size == st.st_size
+			? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		if (data == MAP_FAILED)
+		{
+			if (fd >= 0)
+				close(fd);
+			printf("Cannot load the file.\n");
+			return EC_NOFILE;
+		}
+		if (validate_ddd(stdout, path, data, st.st_size) > 0)
+		{
+			munmap(data, st.st_size);
+			close(fd);
+			return EC_BADFILE;
+		}
+		struct ddd_tables *tables = decode_ddd(data);
+		if (!tables)
+		{
+			munmap(data, st.st_size);
+			close(fd);
+			printf("Out of memory.\n");
+			return EC_NOOP;
+		}
+
+		// take a free slot or the least recently used one, then keep within the byte budget
+		entry = &ddd_cache.entries[0];
+		for (int i = 0; i < CACHE_ENTRIES; ++i)
+		{
+			struct cache_entry *e = &ddd_cache.entries[i];
+			if (!e->data)
+			{
+				entry = e;
+				break;
+			}
+			if (e->last_used < entry->last_used)
+				entry = e;
+		}
+		if (entry->data)
+			cache_evict(entry);
+		while (ddd_cache.bytes + st.st_size > CACHE_BYTES)
+		{
+			struct cache_entry *oldest = NULL;
+			for (int i = 0; i < CACHE_ENTRIES; ++i)
+				if (ddd_cache.entries[i].data && (!oldest || ddd_cache.entries[i].last_used < oldest->last_used))
+					oldest = &ddd_cache.entries[i];
+			if (!oldest)
+				break;
+			cache_evict(oldest);
+		}
+
+		entry->dev = st.st_dev;
+		entry->ino = st.st_ino;
+		entry->mtime = fst.st_mtim;
+		entry->size = st.st_size;
+		entry->fd = fd;
+		entry->data = data;
+		entry->tables = tables;
+		ddd_cache.bytes += st.st_size;
+	}
+
+	entry->last_used = ++ddd_cache.clock;
+	ddd = entry->data;
+	ddd_size = entry->size;
+	ddd_tables = entry->tables;
+	return EC_NONE;
+}
+
+void release_ddd(void)
+{
+	// cached buffers and tables belong to the cache
+	if (!ddd_cache.enabled)
+	{
+		free(ddd);
+		if (ddd_tables)
+			free(ddd_tables->frames);
+		free(ddd_tables);
+	}
+	ddd = NULL;
+	ddd_tables = NULL;
+}
+
+int serve(const char *socket_path)
+{
+	ddd_cache.enabled = 1;
+	if (!socket_path)
+		return serve_stream(stdin, stdout);
+
+	signal(SIGPIPE, SIG_IGN);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		printf("Socket path too long.\n");
+		return EC_NOARGS;
+	}
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server, 8) < 0)
+	{
+		printf("Cannot listen on %s.\n", socket_path);
+		return EC_WRERR;
+	}
+
+	// clients are served one at a time, a quit job stops the server
+	int quit = 0;
+	int ret = EC_NONE;
+	while (!quit)
+	{
+		int client = accept(server, NULL, NULL);
+		if (client < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// out of descriptors or memory, wait for some to be released
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+			{
+				nanosleep(&(struct timespec){ 0, 100000000 }, NULL);
+				continue;
+			}
+			printf("Cannot accept clients on %s.\n", socket_path);
+			ret = EC_WRERR;
+			break;
+		}
+		// reading and writing need their own descriptors, closing one stream must not close the other
+		int client_out = dup(client);
+		FILE *in = fdopen(client, "r");
+		FILE *out = client_out < 0 ? NULL : fdopen(client_out, "w");
+		if (in && out)
+			quit = serve_stream(in, out);
+		if (in) fclose(in); else close(client);
+		if (out) fclose(out); else if (client_out >= 0) close(client_out);
+	}
+
+	close(server);
+	unlink(socket_path);
+	return ret;
+}
+
+int client(const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+	{
+		printf("Socket path too long.\n");
+		return EC_NOARGS;
+	}
+	strcpy(addr.sun_path, socket_path);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0 || connect(server, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		printf("Cannot connect to %s.\n", socket_path);
+		if (server >= 0)
+			close(server);
+		return EC_NOFILE;
+	}
+
+	// jobs are forwarded while results are read, so neither side blocks on a full socket
+	signal(SIGPIPE, SIG_IGN);
+	fcntl(server, F_SETFL, O_NONBLOCK);
+	char jobs[4096], results[4096];
+	ssize_t pending = 0, sent = 0;
+	int ret = EC_NONE;
+	struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { server, POLLIN, 0 } };
+	while (1)
+	{
+		// stdin is only read once the previous chunk has been sent
+		fds[0].events = pending ? 0 : POLLIN;
+		fds[1].events = pending ? POLLIN | POLLOUT : POLLIN;
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ret = EC_WRERR;
+			break;
+		}
+		if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			ssize_t size = read(server, results, sizeof(results));
+			if (size == 0 || (size < 0 && errno != EAGAIN && errno != EINTR))
+				break;
+			if (size > 0)
+			{
+				fwrite(results, 1, size, stdout);
+				fflush(stdout);
+			}
+		}
+		if (pending && (fds[1].revents & POLLOUT))
+		{
+			ssize_t written = write(server, jobs + sent, pending - sent);
+			if (written < 0 && errno != EAGAIN && errno != EINTR)
+			{
+				printf("Cannot send jobs to %s.\n", socket_path);
+				ret = EC_WRERR;
+				break;
+			}
+			if (written > 0 && (sent += written) == pending)
+				pending = sent = 0;
+		}
+		if (fds[0].revents)
+		{
+			pending = read(STDIN_FILENO, jobs, sizeof(jobs));
+			if (pending <= 0)
+			{
+				// no more jobs, the server closes the connection after the last result
+				shutdown(server, SHUT_WR);
+				fds[0].fd = -1;
+				pending = 0;
+			}
+		}
+	}
+	close(server);
+	return ret;
+}
+
+int serve_stream(FILE *in, FILE *out)
+{
+	char *line = NULL;
+	size_t capacity = 0;
+	int quit = 0;
+	while (!quit && getline(&line, &capacity, in) > 0)
+	{
+		if (line[0] == '\n' || line[0] == '\r')
+			continue;
+		quit = run_job(line, out);
+		fflush(out);
+	}
+	free(line);
+	return quit;
+}
+
+int run_job(const char *line, FILE *out)
+{
+	char id[64], op[32], path[PATH_MAX], output[PATH_MAX], dir[PATH_MAX];
+	char threads[32], compress[32], tolerance_text[32];
+	int has_id = json_get_string(line, "id", id, sizeof(id));
+	int has_op = json_get_string(line, "op", op, sizeof(op));
+	int has_path = json_get_string(line, "path", path, sizeof(path));
+	int has_output = json_get_string(line, "output", output, sizeof(output));
+	int has_threads = json_get_string(line, "threads", threads, sizeof(threads));
+	int has_compress = json_get_string(line, "compress", compress, sizeof(compress));
+	int has_dir = json_get_string(line, "dir", dir, sizeof(dir));
+	int has_tolerance = json_get_string(line, "tolerance", tolerance_text, sizeof(tolerance_text));
+
+	// a value that is cut short or cannot be decoded rejects the whole job
+	const char *invalid = has_id < 0 ? "id" : has_op < 0 ? "op" : has_path < 0 ? "path"
+		: has_output < 0 ? "output" : has_threads < 0 ? "threads" : has_compress < 0 ? "compress"
+		: has_dir < 0 ? "dir" : has_tolerance < 0 ? "tolerance" : NULL;
+
+	if (!invalid && !strcmp(op, "quit"))
+	{
+		fprintf(out, "{\"id\":");
+		fwrite_json_string(out, id, strlen(id));
+		fprintf(out, ",\"status\":%d}\n", EC_NONE);
+		return 1;
+	}
+
+	// per job settings
+	thread_num = has_threads > 0 ? atoi(threads) : 0;
+	output_compression = COMPRESSION_NONE;
+	if (has_compress > 0)
+		output_compression = !strcmp(compress, "gz") ? COMPRESSION_GZ : !strcmp(compress, "zst") ? COMPRESSION_ZSTD : -1;
+	int cwd = -1;
+	if (!invalid && has_dir > 0)
+		cwd = open(".", O_RDONLY | O_DIRECTORY);
+
+	// the log of the job is sent back with the result; the descriptor of stdout
+	// points to a temporary file while the job and all of its threads run
+	fflush(stdout);
+	FILE *log_file = tmpfile();
+	int saved_stdout = log_file ? dup(STDOUT_FILENO) : -1;
+	if (saved_stdout >= 0 && dup2(fileno(log_file), STDOUT_FILENO) < 0)
+	{
+		close(saved_stdout);
+		saved_stdout = -1;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int status = EC_NOOP;
+	ddd_cache.hit = 0;
+	if (invalid)
+	{
+		printf("Invalid or too long value of %s.\n", invalid);
+		status = EC_NOARGS;
+	}
+	else if (cwd >= 0 && chdir(dir) < 0)
+	{
+		printf("Cannot change directory to %s.\n", dir);
+		status = EC_NOFILE;
+	}
+	else if ((output_compression == COMPRESSION_GZ && !HAVE_COMPRESSION_GZ)
+		|| (output_compression == COMPRESSION_ZSTD && !HAVE_COMPRESSION_ZSTD) || output_compression < 0)
+	{
+		printf("Compression not available.\n");
+		status = EC_NOARGS;
+	}
+	else if (has_path <= 0)
+	{
+		printf("No input file given.\n");
+		status = EC_NOARGS;
+	}
+	else if (!strcmp(op, "obj"))
+		status = ddd_to_obj(path);
+	else if (!strcmp(op, "ddd"))
+		status = obj_to_ddd(path);
+	else if (!strcmp(op, "gpu"))
+		status = ddd_to_gpu(path);
+	else if (!strcmp(op, "bvh"))
+		status = ddd_to_bvh(path);
+	else if (!strcmp(op, "dedup"))
+		status = dedup_ddd(path, has_output > 0 ? output : NULL);
+	else if (!strcmp(op, "reduce"))
+	{
+		float tolerance;
+		if (has_tolerance <= 0 || parse_tolerance(tolerance_text, &tolerance) < 0)
+		{
+			printf("Tolerance must be a non-negative number.\n");
+			status = EC_NOARGS;
+		}
+		else
+			status = reduce_ddd(path, tolerance, has_output > 0 ? output : NULL);
+	}
+	else if (!strcmp(op, "verify"))
+	{
+		char *paths[1] = { path };
+		status = verify_files(1, paths, 1);
+	}
+	else if (!strcmp(op, "validate"))
+	{
+		status = load_ddd(path);
+		release_ddd();
+	}
+	else
+		printf("Unknown operation %s.\n", op);
+	int cached = ddd_cache.hit;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+
+	char *log = NULL;
+	size_t log_size = 0;
+	if (saved_stdout >= 0)
+	{
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+		off_t size = lseek(fileno(log_file), 0, SEEK_END);
+		log = size > 0 ? malloc(size) : NULL;
+		if (log && pread(fileno(log_file), log, size, 0) == size)
+			log_size = size;
+	}
+	if (log_file)
+		fclose(log_file);
+	if (cwd >= 0)
+	{
+		if (fchdir(cwd) < 0)
+			status = EC_NOFILE;
+		close(cwd);
+	}
+
+	fprintf(out, "{\"id\":");
+	fwrite_json_string(out, id, strlen(id));
+	fprintf(out, ",\"op\":");
+	fwrite_json_string(out, op, strlen(op));
+	fprintf(out, ",\"status\":%d,\"cached\":%s,\"ms\":%.3f,\"log\":", status, cached ? "true" : "false", ms);
+	fwrite_json_string(out, log ? log : "", log ? log_size : 0);
+	fprintf(out, "}\n");
+	free(log);
+	return 0;
+}
+
+// value of four hex digits, -1 if they are not
+static int json_hex4(const char *p)
+{
+	int value = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		int c = p[i];
+		int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (digit < 0)
+			return -1;
+		value = value * 16 + digit;
+	}
+	return value;
+}
+
+int json_get_string(const char *json, const char *key, char *value, size_t size)
+{
+	// looks up a top level "key": value pair of a flat object, strings are
+	// unescaped and other values are copied as they are; returns 0 if the key
+	// is missing and -1 if the value is malformed or does not fit
+	size_t key_len = strlen(key);
+	const char *p = json;
+	value[0] = 0;
+	while ((p = strchr(p, '"')))
+	{
+		++p;
+		if (strncmp(p, key, key_len) || p[key_len] != '"')
+		{
+			// skip the rest of this string
+			while (*p && *p != '"')
+				p += (*p == '\\' && p[1]) ? 2 : 1;
+			if (!*p)
+				return 0;
+			++p;
+			continue;
+		}
+		p += key_len + 1;
+		while (*p == ' ' || *p == '\t') ++p;
+		if (*p != ':')
+			continue;
+		++p;
+		while (*p == ' ' || *p == '\t') ++p;
+
+		size_t n = 0;
+		if (*p == '"')
+		{
+			for (++p; *p != '"'; ++p)
+			{
+				if (!*p)
+					goto malformed;
+				if (*p != '\\')
+				{
+					if (n + 1 >= size)
+						goto malformed;
+					value[n++] = *p;
+					continue;
+				}
+
+				long c;
+				switch (*++p)
+				{
+				case '"': case '\\': case '/': c = *p; break;
+				case 'b': c = '\b'; break;
+				case 'f': c = '\f'; break;
+				case 'n': c = '\n'; break;
+				case 'r': c = '\r'; break;
+				case 't': c = '\t'; break;
+				case 'u':
+					c = json_hex4(p + 1);
+					p += 4;
+					// characters outside the BMP come as a surrogate pair
+					if (c >= 0xdc00 && c <= 0xdfff)
+						goto malformed;
+					if (c >= 0xd800 && c <= 0xdbff)
+					{
+						int low = p[1] == '\\' && p[2] == 'u' ? json_hex4(p + 3) : -1;
+						if (low < 0xdc00 || low > 0xdfff)
+							goto malformed;
+						c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+						p += 6;
+					}
+					break;
+				default: goto malformed;
+				}
+				// strings are NUL terminated, so an embedded NUL cannot be passed on
+				if (c <= 0)
+					goto malformed;
+
+				int len = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+				if (n + len >= size)
+					goto malformed;
+				if (len == 1)
+					value[n++] = c;
+				else
+				{
+					value[n++] = (len == 2 ? 0xc0 : len == 3 ? 0xe0 : 0xf0) | (c >> (6 * (len - 1)));
+					for (int k = len - 2; k >= 0; --k)
+						value[n++] = 0x80 | ((c >> (6 * k)) & 0x3f);
+				}
+			}
+		}
+		else
+		{
+			for (; *p && *p != ',' && *p != '}' && *p != ' ' && *p != '\n'; ++p)
+			{
+				if (n + 1 >= size)
+					goto malformed;
+				value[n++] = *p;
+			}
+		}
+		value[n] = 0;
+		return 1;
+	}
+	return 0;
+
+malformed:
+	value[0] = 0;
+	return -1;
+}
+
+void fwrite_json_string(FILE *file, const char *string, size_t size)
+{
+	fputc('"', file);
+	for (size_t i = 0; i < size; ++i)
+	{
+		unsigned char ch = string[i];
+		if (ch == '"' || ch == '\\')
+			fprintf(file, "\\%c", ch);
+		else if (ch == '\n')
+			fputs("\\n", file);
+		else if (ch < 0x20)
+			fprintf(file, "\\u%04x", ch);
+		else
+			fputc(ch, file);
+	}
+	fputc('"', file);
+}
+
+int load_file(const char *filename, unsigned char **buff, size_t *size)
+{
+	FILE *input = fopen(filename, "rb");
+	if (NULL == input)
+	{
+		return -1;
+	}
+
+	fseek(input, 0, SEEK_END);
+	*size = ftell(input);
+
+	if (*buff) free(*buff);
+	*buff = (unsigned char *)malloc(*size);
+	if (*buff == NULL)
+	{
+		fclose(input);
+		return -2;
+	}
+
+	fseek(input, 0, SEEK_SET);
+	fread(*buff, *size, 1, input);
+	fclose(input);
+	return 0;
+}
+
+// Batch I/O stage. Up to IO_BATCH_DEPTH input files are read ahead of the
+// converters and outputs are written in the background, so that storage
+// latency overlaps with conversion. One thread drives an io_uring when the
+// kernel has one, otherwise a few threads do blocking reads and writes.
+
+struct io_write
+{
+	struct io_write *next;
+	char *path;
+	unsigned char *data;
+	size_t size;
+	size_t done;
+	int fd;
+	int step;
+};
+
+struct io_slot
+{
+	int state;
+	int step;
+	int fd;
+	size_t done;
+	struct io_file file;
+	struct statx stx;
+};
+
+#ifdef HAVE_IO_URING
+struct io_ring
+{
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned int inflight;	// submitted and not completed, besides the wake up read
+};
+
+// completions are told apart by the upper half of user_data
+#define IO_OP_WAKE					(0ull << 32)
+#define IO_OP_SLOT					(1ull << 32)
+#define IO_OP_WRITE					(2ull << 32)
+#define IO_OP_CLOSE					(3ull << 32)
+#endif
+
+struct io_batch
+{
+	char **paths;
+	int count;
+	int started;	// next file to read
+	int consumed;	// next file to hand out
+	int closing;
+	int write_queued;	// writes waiting or in progress
+	int write_failed;
+	struct io_write *writes;
+	struct io_write **writes_tail;
+	struct io_slot slots[IO_BATCH_DEPTH];
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;	// a file was read or a write finished
+	pthread_cond_t work;	// a slot or a write is waiting for the I/O threads
+	pthread_t threads[IO_FALLBACK_THREADS];
+	int thread_count;
+#ifdef HAVE_IO_URING
+	struct io_ring ring;
+	struct io_write *inflight_writes[IO_BATCH_DEPTH];
+	uint64_t wake_count;
+	int wake_fd;
+#endif
+};
+
+static void io_batch_wake(struct io_batch *io)
+{
+#ifdef HAVE_IO_URING
+	if (io->wake_fd >= 0)
+	{
+		uint64_t one = 1;
+		if (write(io->wake_fd, &one, sizeof(one)) < 0)
+			perror("eventfd");
+	}
+#endif
+	pthread_cond_broadcast(&io->work);
+}
 
-	// ===> write a single base model
-	long int vtv_offset = ftell(out);
-	fwrite_short(out, 0);	// number of vertices - placeholder
-	fwrite_short(out, 0);	// number of texture vertices - placeholder
-	fwrite_short(out, 2);	// number of joints
-	fwrite_short(out, 1);	// number of bones
+static void io_write_done(struct io_batch *io, struct io_write *w, int error)
+{
+	if (error)
+		printf("Cannot write %s file: %s.\n", w->path, strerror(error));
+	free(w->data);
+	free(w->path);
+	free(w);
+
+	pthread_mutex_lock(&io->mutex);
+	--io->write_queued;
+	io->write_failed += error != 0;
+	pthread_cond_broadcast(&io->ready);
+	pthread_mutex_unlock(&io->mutex);
+}
 
-	// loop over vertices
-	int vertex_num = 0;
-	fseek(in, 0, SEEK_SET);
-	while (!feof(in))
+static void *io_fallback_worker(void *arg)
+{
+	struct io_batch *io = arg;
+	pthread_mutex_lock(&io->mutex);
+	for (;;)
 	{
-		float x, y, z;
-		if (fscanf(in, "v %f %f %f", &x, &y, &z) == 3)
+		if (io->writes)
 		{
-			// coordinates
-			fwrite_short(out, (signed short)(x / scale));
-			fwrite_short(out, (signed short)(y / scale));
-			fwrite_short(out, (signed short)(z / scale));
-			// bone binding
-			fwrite_byte(out, 0);
-			fwrite_byte(out, 0);
-			// bone weighting
-			fwrite_byte(out, (unsigned char)(0.5f * 255.0f) >> 1);
-
-			++vertex_num;
+			struct io_write *w = io->writes;
+			io->writes = w->next;
+			if (!io->writes)
+				io->writes_tail = &io->writes;
+			pthread_mutex_unlock(&io->mutex);
+
+			int error = 0;
+			FILE *out = fopen(w->path, "wb");
+			if (!out || fwrite(w->data, 1, w->size, out) != w->size)
+				error = errno ? errno : EIO;
+			if (out && fclose(out) && !error)
+				error = errno ? errno : EIO;
+			io_write_done(io, w, error);
+
+			pthread_mutex_lock(&io->mutex);
+			continue;
 		}
 
-		// start at a new line
-		int ch = 0;
-		while ('\n' != ch && EOF != ch)
+		struct io_slot *slot = &io->slots[io->started % IO_BATCH_DEPTH];
+		if (!io->closing && io->started < io->count && slot->state == IO_SLOT_FREE)
 		{
-			ch = fgetc(in);
+			int i = io->started++;
+			slot->state = IO_SLOT_BUSY;
+			slot->file.index = i;
+			slot->file.path = io->paths[i];
+			pthread_mutex_unlock(&io->mutex);
+
+			unsigned char *data = NULL;
+			size_t size = 0;
+			errno = 0;
+			int error = load_file(io->paths[i], &data, &size) < 0 ? (errno ? errno : EIO) : 0;
+
+			pthread_mutex_lock(&io->mutex);
+			slot->file.data = error ? NULL : data;
+			slot->file.size = error ? 0 : size;
+			slot->file.error = error;
+			slot->state = IO_SLOT_READY;
+			pthread_cond_broadcast(&io->ready);
+			continue;
 		}
-	}
 
-	// loop over texture vertices
-	int texture_vertex_num = 0;
-	fseek(in, 0, SEEK_SET);
-	while (!feof(in))
-	{
-		float x, y;
-		if (fscanf(in, "vt %f %f", &x, &y) == 2)
-		{
-			// coordinates
-			fwrite_short(out, (signed short)(x * 256.0f));
-			fwrite_short(out, (signed short)(-y * 256.0f));
+		if (io->closing)
+			break;
+		pthread_cond_wait(&io->work, &io->mutex);
+	}
+	pthread_mutex_unlock(&io->mutex);
+	return NULL;
+}
 
-			++texture_vertex_num;
-		}
+#ifdef HAVE_IO_URING
+static int io_ring_setup(struct io_ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
 
-		// start at a new line
-		int ch = 0;
-		while ('\n' != ch && EOF != ch)
-		{
-			ch = fgetc(in);
-		}
+	// every operation the stage uses has to be there (5.6 and newer kernels)
+	size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probe_size);
+	int supported = probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) >= 0;
+	static const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+	for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); ++i)
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!supported)
+	{
+		close(ring->fd);
+		return -1;
 	}
-	// write a dummy texture vertex if none exist
-	if (0 == texture_vertex_num)
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = ring->sq_ptr;
+	if (ring->sq_ptr != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
 	{
-		// coordinates
-		fwrite_short(out, (signed short)(0 * 256.0f));
-		fwrite_short(out, (signed short)(-0 * 256.0f));
-		++texture_vertex_num;
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqes_size);
+		if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+			munmap(ring->cq_ptr, ring->cq_size);
+		if (ring->sq_ptr != MAP_FAILED)
+			munmap(ring->sq_ptr, ring->sq_size);
+		close(ring->fd);
+		return -1;
 	}
 
-	// textures
-	long int face_num_offset[MAX_DDD_TEXTURE] = { 0, 0, 0, 0 };
-	int face_num[MAX_DDD_TEXTURE] = { 0, 0, 0, 0 };
-	int current_texture_idx = 0;
-	char texture_started = 0;
-	fseek(in, 0, SEEK_SET);
-	// loop over faces
-	while (!feof(in))
+	unsigned char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring->sq_entries = params.sq_entries;
+	return 0;
+}
+
+static void io_ring_release(struct io_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+// prepared entries stay in the submission queue until the kernel takes them
+static unsigned int io_ring_pending(struct io_ring *ring)
+{
+	return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// submits the prepared entries and waits for min_complete completions
+static int io_ring_enter(struct io_ring *ring, unsigned int min_complete)
+{
+	return syscall(__NR_io_uring_enter, ring->fd, io_ring_pending(ring), min_complete,
+		min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// makes room for one more entry, -1 if the kernel takes none of the prepared ones
+static int io_ring_reserve(struct io_ring *ring)
+{
+	while (io_ring_pending(ring) >= ring->sq_entries)
 	{
-		int ix, itx, iy, ity, iz, itz;
-		char cname[160];
-		fscanf(in, "%s", cname);
-		if (!strcmp(cname, "f"))
-		{
-			fscanf(in, "%[^\n]", cname);
-			cname[strlen(cname) + 1] = '\0'; // double null ends the string
+		int ret = io_ring_enter(ring, 0);
+		if (ret == 0 || (ret < 0 && errno != EINTR))
+			return -1;
+	}
+	return 0;
+}
 
-			char *endptr = NULL;
-			endptr = read_triplet(cname, &ix, &itx, NULL);
-			if (0 == itx) itx = 1;
-			endptr = read_triplet(endptr, &iy, &ity, NULL);
-			if (0 == ity) ity = 1;
-			endptr = read_triplet(endptr, &iz, &itz, NULL);
-			if (0 == itz) itz = 1;
+// every step prepares at most one entry, callers reserve room for it first
+static struct io_uring_sqe *io_ring_sqe(struct io_ring *ring, int opcode, int fd, uint64_t user_data)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (user_data >> 32 != IO_OP_WAKE >> 32)
+		++ring->inflight;
+	return sqe;
+}
 
-			if (!texture_started)
-			{
-				fwrite_byte(out, 1);	// rendering mode on
-				fwrite_byte(out, 0);	// flags
-				fwrite_byte(out, 255);	// alpha
-				face_num_offset[current_texture_idx] = ftell(out);
-				fwrite_short(out, 0);	// number of faces - placeholder
-				texture_started = 1;
-			}
+static void io_ring_wake_read(struct io_batch *io)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe(&io->ring, IORING_OP_READ, io->wake_fd, IO_OP_WAKE);
+	sqe->addr = (uintptr_t)&io->wake_count;
+	sqe->len = sizeof(io->wake_count);
+}
 
-			// three vertex - texture vertex pairs
-			fwrite_short(out, ix - 1);
-			fwrite_short(out, itx - 1);
-			fwrite_short(out, iy - 1);
-			fwrite_short(out, ity - 1);
-			fwrite_short(out, iz - 1);
-			fwrite_short(out, itz - 1);
+static void io_ring_slot_step(struct io_batch *io, int index)
+{
+	struct io_slot *slot = &io->slots[index];
+	struct io_uring_sqe *sqe;
+	switch (slot->step)
+	{
+	case IO_STEP_STATX:
+		sqe = io_ring_sqe(&io->ring, IORING_OP_STATX, AT_FDCWD, IO_OP_SLOT | index);
+		sqe->addr = (uintptr_t)slot->file.path;
+		sqe->len = STATX_SIZE;
+		sqe->off = (uintptr_t)&slot->stx;
+		break;
+	case IO_STEP_OPEN:
+		sqe = io_ring_sqe(&io->ring, IORING_OP_OPENAT, AT_FDCWD, IO_OP_SLOT | index);
+		sqe->addr = (uintptr_t)slot->file.path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		break;
+	case IO_STEP_READ:
+	{
+		size_t left = slot->file.size - slot->done;
+		sqe = io_ring_sqe(&io->ring, IORING_OP_READ, slot->fd, IO_OP_SLOT | index);
+		sqe->addr = (uintptr_t)(slot->file.data + slot->done);
+		sqe->len = left < IO_MAX_CHUNK ? left : IO_MAX_CHUNK;
+		sqe->off = slot->done;
+		break;
+	}
+	}
+}
 
-			++face_num[current_texture_idx];
+static void io_ring_write_step(struct io_batch *io, int index)
+{
+	struct io_write *w = io->inflight_writes[index];
+	struct io_uring_sqe *sqe;
+	switch (w->step)
+	{
+	case IO_STEP_OPEN:
+		sqe = io_ring_sqe(&io->ring, IORING_OP_OPENAT, AT_FDCWD, IO_OP_WRITE | index);
+		sqe->addr = (uintptr_t)w->path;
+		sqe->len = 0666;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+		break;
+	case IO_STEP_WRITE:
+	{
+		size_t left = w->size - w->done;
+		sqe = io_ring_sqe(&io->ring, IORING_OP_WRITE, w->fd, IO_OP_WRITE | index);
+		sqe->addr = (uintptr_t)(w->data + w->done);
+		sqe->len = left < IO_MAX_CHUNK ? left : IO_MAX_CHUNK;
+		sqe->off = w->done;
+		break;
+	}
+	case IO_STEP_CLOSE:
+		io_ring_sqe(&io->ring, IORING_OP_CLOSE, w->fd, IO_OP_WRITE | index);
+		break;
+	}
+}
 
-			// check for n-gons where n > 3
-			// convex only
-			while (iz > 0)
-			{
-				iy = iz;
-				ity = itz;
-				endptr = read_triplet(endptr, &iz, &itz, NULL);
-				if (0 == itz) itz = 1;
-				if (iz > 0)
-				{
-					// three vertex - texture vertex pairs
-					fwrite_short(out, ix - 1);
-					fwrite_short(out, itx - 1);
-					fwrite_short(out, iy - 1);
-					fwrite_short(out, ity - 1);
-					fwrite_short(out, iz - 1);
-					fwrite_short(out, itz - 1);
+static void io_ring_slot_done(struct io_batch *io, struct io_slot *slot, int error)
+{
+	if (error)
+	{
+		free(slot->file.data);
+		slot->file.data = NULL;
+		slot->file.size = 0;
+	}
+	// closing does not keep the file from the converters
+	if (slot->step >= IO_STEP_READ)
+		io_ring_sqe(&io->ring, IORING_OP_CLOSE, slot->fd, IO_OP_CLOSE);
+
+	pthread_mutex_lock(&io->mutex);
+	slot->file.error = error;
+	slot->state = IO_SLOT_READY;
+	pthread_cond_broadcast(&io->ready);
+	pthread_mutex_unlock(&io->mutex);
+}
 
-					++face_num[current_texture_idx];
-				}
-			}
+static void io_ring_slot_complete(struct io_batch *io, int index, int res)
+{
+	struct io_slot *slot = &io->slots[index];
+	if (res < 0)
+	{
+		io_ring_slot_done(io, slot, -res);
+		return;
+	}
+	switch (slot->step)
+	{
+	case IO_STEP_STATX:
+		slot->file.size = slot->stx.stx_size;
+		slot->file.data = malloc(slot->file.size ? slot->file.size : 1);
+		if (!slot->file.data)
+		{
+			io_ring_slot_done(io, slot, ENOMEM);
+			return;
 		}
-		else if (!strcmp(cname, "usemtl"))
+		slot->step = IO_STEP_OPEN;
+		break;
+	case IO_STEP_OPEN:
+		slot->fd = res;
+		slot->done = 0;
+		slot->step = IO_STEP_READ;
+		if (!slot->file.size)
 		{
-			if (texture_started && current_texture_idx < (MAX_DDD_TEXTURE - 1))
-			{
-				++current_texture_idx;
-				texture_started = 0;
-			}
+			io_ring_slot_done(io, slot, 0);
+			return;
 		}
-
-		// start at a new line
-		int ch = 0;
-		while ('\n' != ch && EOF != ch)
+		break;
+	case IO_STEP_READ:
+		slot->done += res;
+		// a file that shrank since statx ends early
+		if (!res)
+			slot->file.size = slot->done;
+		if (slot->done == slot->file.size)
 		{
-			ch = fgetc(in);
+			io_ring_slot_done(io, slot, 0);
+			return;
 		}
+		break;
 	}
+	io_ring_slot_step(io, index);
+}
 
-	// rendering mode off for unused textures
-	for (int i = current_texture_idx + texture_started; i < MAX_DDD_TEXTURE; ++i)
+static void io_ring_write_complete(struct io_batch *io, int index, int res)
+{
+	struct io_write *w = io->inflight_writes[index];
+	if (res < 0 || (w->step == IO_STEP_WRITE && !res))
 	{
-		fwrite_byte(out, 0);
+		if (w->step == IO_STEP_WRITE)
+			io_ring_sqe(&io->ring, IORING_OP_CLOSE, w->fd, IO_OP_CLOSE);
+		io->inflight_writes[index] = NULL;
+		io_write_done(io, w, res < 0 ? -res : EIO);
+		return;
 	}
+	switch (w->step)
+	{
+	case IO_STEP_OPEN:
+		w->fd = res;
+		w->step = w->size ? IO_STEP_WRITE : IO_STEP_CLOSE;
+		break;
+	case IO_STEP_WRITE:
+		w->done += res;
+		if (w->done == w->size)
+			w->step = IO_STEP_CLOSE;
+		break;
+	case IO_STEP_CLOSE:
+		io->inflight_writes[index] = NULL;
+		io_write_done(io, w, 0);
+		return;
+	}
+	io_ring_write_step(io, index);
+}
 
-	// joints
-	fwrite_byte(out, 0.0f / JOINT_COLLISION_SCALE);
-	fwrite_byte(out, 0.0f / JOINT_COLLISION_SCALE);
-
-	// bones
-	fwrite_byte(out, 0);	// bone id
-	fwrite_short(out, 1);
-	fwrite_short(out, 0);
-
-	// ===> write a single bone frame
-	fwrite_byte(out, 0);	// action name (0 = boning)
-	fwrite_byte(out, 0);	// action modifier flags
-	fwrite_byte(out, 0);	// base model id
-	fwrite_short(out, 0);	// X movement offset
-	fwrite_short(out, 0);	// Y movement offset
-
-	// 1 bone forward normal
-	fwrite_short(out, 0);	// X
-	fwrite_short(out, -1);	// Y
-	fwrite_short(out, 0);	// Z
+static void *io_ring_worker(void *arg)
+{
+	struct io_batch *io = arg;
+	struct io_ring *ring = &io->ring;
+	io_ring_wake_read(io);
+	for (;;)
+	{
+		// start reads into free slots and queued writes
+		pthread_mutex_lock(&io->mutex);
+		while (!io->closing && io->started < io->count && io->slots[io->started % IO_BATCH_DEPTH].state == IO_SLOT_FREE
+			&& !io_ring_reserve(ring))
+		{
+			int index = io->started % IO_BATCH_DEPTH;
+			struct io_slot *slot = &io->slots[index];
+			slot->state = IO_SLOT_BUSY;
+			slot->step = IO_STEP_STATX;
+			slot->file.index = io->started;
+			slot->file.path = io->paths[io->started];
+			slot->file.data = NULL;
+			slot->file.size = 0;
+			++io->started;
+			io_ring_slot_step(io, index);
+		}
+		for (int i = 0; io->writes && i < IO_BATCH_DEPTH; ++i)
+		{
+			if (io->inflight_writes[i])
+				continue;
+			if (io_ring_reserve(ring))
+				break;
+			struct io_write *w = io->writes;
+			io->writes = w->next;
+			if (!io->writes)
+				io->writes_tail = &io->writes;
+			w->step = IO_STEP_OPEN;
+			io->inflight_writes[i] = w;
+			io_ring_write_step(io, i);
+		}
+		int finished = io->closing && !ring->inflight && !io->write_queued;
+		pthread_mutex_unlock(&io->mutex);
+		if (finished)
+			break;
 
-	// 2 joints
-	fwrite_short(out, 0);	// X
-	fwrite_short(out, 0);	// Y
-	fwrite_short(out, (signed short)(1.0f / scale));	// Z
+		// entries the kernel did not take stay queued and are submitted next time
+		if (io_ring_enter(ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			perror("io_uring_enter");
+			break;
+		}
 
-	fwrite_short(out, 0);	// X
-	fwrite_short(out, 0);	// Y
-	fwrite_short(out, (signed short)(2.0f / scale));	// Z
+		// completions that find no room are handled after the next submission
+		unsigned int head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) && !io_ring_reserve(ring))
+		{
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			__atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
 
-	// shadow texture data (alpha only)
-	for (int i = 0; i < MAX_DDD_SHADOW_TEXTURE; ++i)
-		fwrite_byte(out, 0);
+			int index = user_data & 0xffffffff;
+			switch (user_data >> 32)
+			{
+			case IO_OP_WAKE >> 32:
+				io_ring_wake_read(io);
+				break;
+			case IO_OP_SLOT >> 32:
+				--ring->inflight;
+				io_ring_slot_complete(io, index, res);
+				break;
+			case IO_OP_WRITE >> 32:
+				--ring->inflight;
+				io_ring_write_complete(io, index, res);
+				break;
+			case IO_OP_CLOSE >> 32:
+				--ring->inflight;
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+#endif
 
-	// fill out placeholders
-	for (int i = 0; i < MAX_DDD_TEXTURE; ++i)
+struct io_batch *io_batch_open(int count, char *paths[])
+{
+	struct io_batch *io = calloc(1, sizeof(*io));
+	if (!io)
+		return NULL;
+	io->paths = paths;
+	io->count = count;
+	io->writes_tail = &io->writes;
+	pthread_mutex_init(&io->mutex, NULL);
+	pthread_cond_init(&io->ready, NULL);
+	pthread_cond_init(&io->work, NULL);
+
+#ifdef HAVE_IO_URING
+	// reads, writes, their closes and the wake up read all fit into the ring
+	io->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (io->wake_fd >= 0 && !io_ring_setup(&io->ring, IO_BATCH_DEPTH * 4))
 	{
-		if (face_num_offset[i] != 0)
+		if (!pthread_create(&io->threads[0], NULL, io_ring_worker, io))
 		{
-			fseek(out, face_num_offset[i], SEEK_SET);
-			fwrite_short(out, face_num[i]);
+			io->thread_count = 1;
+			return io;
 		}
+		io_ring_release(&io->ring);
 	}
-	fseek(out, vtv_offset, SEEK_SET);
-	fwrite_short(out, vertex_num);
-	fwrite_short(out, texture_vertex_num);
+	if (io->wake_fd >= 0)
+		close(io->wake_fd);
+	io->wake_fd = -1;
+#endif
+
+	while (io->thread_count < IO_FALLBACK_THREADS
+		&& !pthread_create(&io->threads[io->thread_count], NULL, io_fallback_worker, io))
+		++io->thread_count;
+	if (!io->thread_count)
+	{
+		free(io);
+		return NULL;
+	}
+	return io;
+}
 
-	fclose(out);
-	fclose(in);
-	return EC_NONE;
+// waits for the next input file, returns 0 when all were handed out
+int io_batch_next(struct io_batch *io, struct io_file *file)
+{
+	pthread_mutex_lock(&io->mutex);
+	if (io->consumed >= io->count)
+	{
+		pthread_mutex_unlock(&io->mutex);
+		return 0;
+	}
+	int i = io->consumed++;
+	struct io_slot *slot = &io->slots[i % IO_BATCH_DEPTH];
+	while (slot->state != IO_SLOT_READY || slot->file.index != i)
+		pthread_cond_wait(&io->ready, &io->mutex);
+	*file = slot->file;
+	slot->state = IO_SLOT_FREE;
+	io_batch_wake(io);
+	pthread_mutex_unlock(&io->mutex);
+	return 1;
 }
 
-int load_file(const char *filename, unsigned char **buff, size_t *size)
+// queues the data to be written to the file, data is freed afterwards
+int io_batch_write(struct io_batch *io, const char *path, unsigned char *data, size_t size)
 {
-	FILE *input = fopen(filename, "rb");
-	if (NULL == input)
+	struct io_write *w = calloc(1, sizeof(*w));
+	char *copy = strdup(path);
+	if (!w || !copy)
 	{
+		free(w);
+		free(copy);
+		free(data);
 		return -1;
 	}
+	w->path = copy;
+	w->data = data;
+	w->size = size;
+
+	pthread_mutex_lock(&io->mutex);
+	while (io->write_queued >= IO_BATCH_DEPTH)
+		pthread_cond_wait(&io->ready, &io->mutex);
+	++io->write_queued;
+	*io->writes_tail = w;
+	io->writes_tail = &w->next;
+	io_batch_wake(io);
+	pthread_mutex_unlock(&io->mutex);
+	return 0;
+}
 
-	fseek(input, 0, SEEK_END);
-	*size = ftell(input);
-
-	if (*buff) free(*buff);
-	*buff = (unsigned char *)malloc(*size);
-	if (*buff == NULL)
+// waits for the queued writes and returns the number of failed ones
+int io_batch_close(struct io_batch *io)
+{
+	pthread_mutex_lock(&io->mutex);
+	io->closing = 1;
+	io_batch_wake(io);
+	pthread_mutex_unlock(&io->mutex);
+	for (int i = 0; i < io->thread_count; ++i)
+		pthread_join(io->threads[i], NULL);
+
+#ifdef HAVE_IO_URING
+	if (io->wake_fd >= 0)
 	{
-		fclose(input);
-		return -2;
+		io_ring_release(&io->ring);
+		close(io->wake_fd);
 	}
-
-	fseek(input, 0, SEEK_SET);
-	fread(*buff, *size, 1, input);
-	fclose(input);
-	return 0;
+#endif
+	// files read ahead that nobody asked for
+	for (int i = 0; i < IO_BATCH_DEPTH; ++i)
+		if (io->slots[i].state == IO_SLOT_READY)
+			free(io->slots[i].file.data);
+
+	int failed = io->write_failed;
+	pthread_cond_destroy(&io->work);
+	pthread_cond_destroy(&io->ready);
+	pthread_mutex_destroy(&io->mutex);
+	free(io);
+	return failed;
 }
 
 unsigned short get_scaling(unsigned char *ddd)
@@ -893,6 +5905,8 @@ unsigned char get_shadow_texture_alpha(unsigned char *shadow_texture_data_entry)
 
 unsigned char *get_base_model_from_id(unsigned char *ddd, unsigned char id)
 {
+	if (ddd_tables && ddd_tables->data == ddd)
+		return ddd_tables->base_models[id];
 	unsigned char *ptr = get_first_base_model(ddd);
 	while (id--) ptr = get_next_base_model(ptr);
 	return ptr;
@@ -900,7 +5914,7 @@ unsigned char *get_base_model_from_id(unsigned char *ddd, unsigned char id)
 
 char *get_texture_flag_string(unsigned char flags)
 {
-	static char buff[256];
+	static __thread char buff[256];
 	buff[0] = 0;
 	if (flags & RENDER_LIGHT_FLAG)
 		strcat(buff, "light ");
@@ -939,6 +5953,31 @@ void fwrite_short(FILE *file, unsigned short word)
 	fwrite(bytes, 2, 1, file);
 }
 
+void fwrite_le_short(FILE *file, unsigned short word)
+{
+	unsigned char bytes[2];
+	bytes[0] = word & 0xff;
+	bytes[1] = word >> 8;
+	fwrite(bytes, 2, 1, file);
+}
+
+void fwrite_le_int(FILE *file, unsigned int dword)
+{
+	unsigned char bytes[4];
+	bytes[0] = dword & 0xff;
+	bytes[1] = (dword >> 8) & 0xff;
+	bytes[2] = (dword >> 16) & 0xff;
+	bytes[3] = dword >> 24;
+	fwrite(bytes, 4, 1, file);
+}
+
+void fwrite_le_float(FILE *file, float value)
+{
+	unsigned int dword;
+	memcpy(&dword, &value, 4);
+	fwrite_le_int(file, dword);
+}
+
 char *read_triplet(char *string, int *a, int *b, int *c)
 {
 	char *pa, *pb, *pc, temp;